@@ -22,10 +22,17 @@
 
 #include "./allocator.h"
 
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "./allocator_interface.h"
 #include "./memlib.h"
@@ -35,41 +42,167 @@
 // #define free(...) (USE_MY_FREE)
 // #define realloc(...) (USE_MY_REALLOC)
 
-// check - This checks our invariant that the size_t header before every
-// block points to either the beginning of the next block, or the end of the
-// heap.
+// free blocks are indexed two-level segregated fit style: the first level
+// is the power of two below the block size, the second level splits every
+// power of two into SL_COUNT equal ranges. one bitmap per level records which
+// lists are non-empty, so finding a list to take a block from is a couple of
+// bit scans instead of a walk over the bins.
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_COUNT 32
 
-#define NUM_BINS 27
-
-int my_check() {
-  char* p;
-  char* lo = (char*)mem_heap_lo();
-  char* hi = (char*)mem_heap_hi() + 1;
-  size_t size = 0;
-
-  p = lo;
-  while (lo <= p && p < hi) {
-    size = ALIGN(*(size_t*)p + SIZE_T_SIZE);
-    p += size;
-  }
-
-  if (p != hi) {
-    printf("Bad headers did not end at heap_hi!\n");
-    printf("heap_lo: %p, heap_hi: %p, size: %lu, p: %p\n", lo, hi, size, p);
-    return -1;
-  }
-
-  return 0;
-}
+// how many blocks of the request's own list best_fit looks at before it
+// falls back to the head of the next non-empty list
+#define FIT_SCAN 8
 
 typedef struct node {
   struct node *next;
   struct node *prev;
 } node;
 
-struct node *freelists[NUM_BINS];
+// free blocks of TREE_MIN bytes and up are kept out of the lists, in a treap
+// ordered by (size, address). a best fit is then one walk down the tree, and
+// ties go to the lowest address. the heap priority of a node is a hash of
+// its address, so it costs no space in the block and the tree stays balanced
+// whatever order the blocks are freed in.
+#define TREE_MIN 4096
+
+typedef struct tnode {
+  struct tnode *left;
+  struct tnode *right;
+} tnode;
+
+// with deferred coalescing, freed heap blocks up to QUICK_MAX bytes are
+// pushed on a list of their exact size and keep looking allocated, so a
+// request of the same size takes them back without touching any tag or bin.
+// they are coalesced in one go when a request finds nothing in the bins, or
+// when a list grows past QUICK_FILL.
+#define QUICK_CLASSES (QUICK_MAX / ALIGNMENT + 1)
+
+// small requests are carved out of page-sized runs of equal slots that carry
+// no header or footer. a run is an ordinary allocated block whose payload
+// starts on a page boundary and is exactly one block short of a page, so runs
+// tile pages without gaps. the slot size lives once, in the run header.
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT + 1)
+#define SLAB_PAGE_SHIFT 12
+#define SLAB_PAGE (1 << SLAB_PAGE_SHIFT)
+#define SLAB_RUN_SIZE (SLAB_PAGE - SIZE_T_SIZE)
+
+typedef struct slab_run {
+  struct slab_run *next; // runs of the same class with free slots
+  struct slab_run *prev;
+  void* free;            // slots handed back, linked through their first word
+  char* bump;            // first slot never handed out
+  int slot;              // slot size
+  int used;              // slots currently handed out
+  int capacity;          // slots in the run
+} slab_run;
+
+#define SLAB_HEADER ALIGN(sizeof(slab_run))
+
+// run owning slab slot p
+#define run_of(p) ((slab_run*)((uintptr_t)(p) & ~(uintptr_t)(SLAB_PAGE - 1)))
+
+// bit of the slab page map covering address p
+#define slab_bit(a,p) (((uintptr_t)(p) >> SLAB_PAGE_SHIFT) - ((uintptr_t)(a)->lo >> SLAB_PAGE_SHIFT))
+
+// counters kept by each arena under its lock for my_malloc_stats. free
+// blocks are counted by the power of two below their size as they enter and
+// leave the bins, so nothing ever has to walk the heap.
+typedef struct arena_stats {
+  size_t bin_blocks[FL_COUNT];
+  size_t bin_bytes[FL_COUNT];
+  size_t sbrk_calls;
+  size_t splits;
+  size_t coalesces;
+} arena_stats;
+
+// an arena is an independent heap: its own bins, its own wilderness block
+// and its own backing region. arena 0 lives in the brk heap from mem_sbrk,
+// the others each reserve a region of ARENA_RESERVE bytes with mem_map the
+// first time a thread is assigned to them. every access to an arena's bins
+// and last pointer happens with its lock held.
+typedef struct arena {
+  pthread_mutex_t lock;
+  uint32_t fl_bitmap;          // bit f set when some list of first level f is non-empty
+  uint32_t sl_bitmap[FL_COUNT]; // bit s of sl_bitmap[f] set when list (f, s) is non-empty
+  struct node *freelists[FL_COUNT][SL_COUNT];
+  void* last; // pointer to current last block in this arena
+  char* lo;   // first byte of the arena's region
+  char* brk;  // first byte after the end of the arena's blocks
+  char* end;  // end of the reserved region, unused for arena 0
+  char* fresh; // highest brk so far, unused for arena 0 whose memlib knows
+  struct tnode *tree; // free blocks of TREE_MIN bytes and up
+  node* quick[QUICK_CLASSES]; // freed blocks not coalesced yet, by size / ALIGNMENT
+  int quick_count[QUICK_CLASSES];
+  int quick_blocks;           // blocks on all quick lists
+  slab_run* slabs[SLAB_CLASSES]; // runs with free slots, by slot size / ALIGNMENT
+  int slab_seen[SLAB_CLASSES]; // requests per class, counted until it gets runs
+  uint64_t* slab_map; // one bit per page of the region, set for slab runs
+  uint64_t decay_at;  // earliest time in ms the next heap_decay may scan
+  node* remote; // blocks freed by threads of other arenas, pushed without the lock
+#if MALLOC_STATS
+  arena_stats stats;
+#endif
+} arena;
+
+#if MALLOC_STATS
+#define STAT(x) (x)
+#else
+#define STAT(x)
+#endif
+
+// counters of the paths that run without an arena lock, updated atomically
+#define STAT_ADD(counter, n) STAT(__atomic_fetch_add (&(counter), (n), __ATOMIC_RELAXED))
+
+#if MALLOC_STATS
+static struct {
+  size_t mmapped_bytes;
+  size_t mmap_calls;
+  size_t munmap_calls;
+  size_t mremap_calls;
+  size_t realloc_in_place;
+  size_t realloc_copy;
+} stats;
+#endif
+
+// slab page bits for the brk heap, the other arenas map theirs with the region
+#define SLAB_MAP_WORDS (ARENA_RESERVE >> (SLAB_PAGE_SHIFT + 6))
+static uint64_t main_slab_map[SLAB_MAP_WORDS];
+
+static arena arenas[NUM_ARENAS] = {
+  [0 ... NUM_ARENAS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+// number of arenas with a backing region, arenas[0] always has one
+static int num_arenas = 1;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void* last; // pointer to current last block in our heap
+// next arena to hand out when assigning threads round-robin
+static int next_arena = 0;
+
+// per-thread stacks of recently freed small blocks, indexed by block size /
+// ALIGNMENT. cached blocks keep their header and still look allocated to the
+// shared heap, so they are linked through the first word of their payload.
+#define TCACHE_CLASSES (TCACHE_MAX / ALIGNMENT + 1)
+
+typedef struct tcache {
+  node* head[TCACHE_CLASSES];
+  int count[TCACHE_CLASSES];
+  int batch[TCACHE_CLASSES]; // blocks to fetch on the next refill
+  int registered;            // thread exit destructor installed
+  arena* arena;              // arena this thread allocates from
+} tcache;
+
+// initial-exec so the preloaded wrapper never goes through __tls_get_addr
+static __thread tcache tc __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void* heap_malloc(arena* a, size_t size);
+static void heap_free(arena* a, void* p);
+static void heap_consolidate(arena* a);
 
 // given pointer to block starting after header, returns pointer to where the header starts
 #define h(p) ((void*)((char*)p - SIZE_T_SIZE))
@@ -77,50 +210,295 @@ void* last; // pointer to current last block in our heap
 // given pointer to block starting after header, returns pointer to where the footer starts
 #define f(p,sz) ((void*)((char*)p + sz - 2*SIZE_T_SIZE))
 
+// sizes are multiples of ALIGNMENT, so the low bits of a header are free for
+// flags: whether the block is allocated and whether the block right before it
+// is. with the second bit in our own header, backward coalescing only needs a
+// footer on free blocks, and allocated blocks pay for nothing but the header.
+// blocks are rounded to ALIGNMENT, so that saves a whole ALIGNMENT step only
+// for requests whose size mod 16 falls in 9..12; on the traces it is noise.
+#define ALLOC 0x1
+#define PREV_ALLOC 0x2
+#define TAG_BITS 0xf
+
+// the owner of an allocated block reads its header without the arena lock
+// (my_free, my_malloc_usable_size) while a neighbour, under the lock, flips
+// its PREV_ALLOC bit. both sides go through relaxed atomics so that is not a
+// data race; the owner never depends on that bit.
+static inline int hdr_load (void* p) {
+  return __atomic_load_n ((int*)h(p), __ATOMIC_RELAXED);
+}
+
+static inline void hdr_store (void* p, int tag) {
+  __atomic_store_n ((int*)h(p), tag, __ATOMIC_RELAXED);
+}
+
+// size of block p without the flag bits
+#define size_of(p) (hdr_load (p) & ~TAG_BITS)
+
+// a free block needs its header, two list pointers and a footer, 24 bytes,
+// and every block may be freed, so allocated blocks can't be any smaller
 #define MIN_BLOCK 32
 #define PERFECT_SIZE (1<<12)
 
+// heap blocks keep their size in a 4-byte tag, so no block in an arena grows
+// past BLOCK_MAX, not even by coalescing. larger requests always get a
+// mapping of their own, which records its length in a full size_t.
+#define BLOCK_MAX (1 << 30)
+#define HEAP_REQUEST_MAX (BLOCK_MAX - SIZE_T_SIZE)
+
+// extend the arena's region by incr bytes, returns (void*)-1 when it is full
+static void* arena_sbrk (arena* a, size_t incr) {
+  STAT(a->stats.sbrk_calls++);
+  if (a == &arenas[0]) {
+    void* p = mem_sbrk(incr);
+    if (p != (void*)-1) a->brk = (char*)p + incr;
+    return p;
+  }
+  if (incr > (size_t)(a->end - a->brk)) return (void*)-1;
+  void* p = a->brk;
+  a->brk += incr;
+  if (a->brk > a->fresh) a->fresh = a->brk;
+  return p;
+}
+
+// give the top decr bytes of the arena's region back, returns -1 when the
+// region cannot shrink. the mapped arenas keep their reservation and only
+// drop the pages past the new end.
+static int arena_shrink (arena* a, size_t decr) {
+  if (a == &arenas[0]) {
+    if (mem_trim (decr) < 0) return -1;
+  } else {
+    uintptr_t page = mem_pagesize ();
+    uintptr_t lo = ((uintptr_t)a->brk - decr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)a->brk + page - 1) & ~(page - 1);
+    if (hi > lo) mem_purge ((void*)lo, hi - lo);
+  }
+  a->brk -= decr;
+  return 0;
+}
+
+static void arena_reset (arena* a) {
+  a->fl_bitmap = 0;
+  a->decay_at = 0;
+  memset (a->sl_bitmap, 0, sizeof (a->sl_bitmap));
+  memset (a->freelists, 0, sizeof (a->freelists));
+  a->tree = NULL;
+  a->remote = NULL;
+#if MALLOC_STATS
+  memset (&a->stats, 0, sizeof (a->stats));
+#endif
+  memset (a->quick, 0, sizeof (a->quick));
+  memset (a->quick_count, 0, sizeof (a->quick_count));
+  a->quick_blocks = 0;
+  memset (a->slabs, 0, sizeof (a->slabs));
+  memset (a->slab_seen, 0, sizeof (a->slab_seen));
+  if (a == &arenas[0]) a->slab_map = main_slab_map;
+  if (a->brk > a->lo) {
+    size_t pages = slab_bit (a, a->brk) + 1;
+    size_t words = (pages + 63) / 64;
+    memset (a->slab_map, 0, (words < SLAB_MAP_WORDS ? words : SLAB_MAP_WORDS) * sizeof (uint64_t));
+  }
+  if (a == &arenas[0]) {
+    a->lo = a->brk = (char*)mem_heap_lo();
+  } else {
+    a->brk = a->lo;
+  }
+  arena_sbrk (a, 12); // sbrk 12 at the start so we can use a header size of 4 and still have 16-alignment
+  a->last = NULL;
+}
+
 int my_init() {
-  for (int i = 0; i < NUM_BINS; i++) {
-    freelists[i] = NULL;
+  for (int i = 0; i < num_arenas; i++) {
+    arena_reset (&arenas[i]);
   }
-  mem_sbrk (12); // sbrk 12 at the start so we can use a header size of 4 and still have 16-alignment
-  last = NULL;
+  // the heap was reset underneath us, so anything cached by this thread is gone
+  memset (&tc.head, 0, sizeof (tc.head));
+  memset (&tc.count, 0, sizeof (tc.count));
+  memset (&tc.batch, 0, sizeof (tc.batch));
   return 0; 
 }
 
-int get_idx (int sz) {
-  int n = 0; 
-  while ((1U << n) <= sz) { 
-    n++; 
-  } 
-  return n - 1;
+// the arena owning block p, found by address since the arena regions never move
+static arena* arena_of (void* p) {
+  int n = __atomic_load_n (&num_arenas, __ATOMIC_ACQUIRE);
+  for (int i = 1; i < n; i++) {
+    if ((char*)p >= arenas[i].lo && (char*)p < arenas[i].end) return &arenas[i];
+  }
+  return &arenas[0];
+}
+
+// pick an arena for the calling thread, round-robin or by the cpu it is
+// running on, and reserve its region if nobody has used it yet. if the region
+// cannot be mapped the thread shares arena 0.
+static arena* arena_assign (void) {
+#ifdef ARENA_BY_CPU
+  int cpu = sched_getcpu ();
+  int i = (cpu < 0 ? 0 : cpu) % NUM_ARENAS;
+#else
+  int i = __atomic_fetch_add (&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS;
+#endif
+  if (i == 0) return &arenas[0];
+
+  pthread_mutex_lock (&arenas_lock);
+  // arenas are created in order so that arena_of only scans mapped ones
+  while (num_arenas <= i) {
+    char* region = (char*)mem_map (ARENA_RESERVE);
+    if (region == (void*)-1) break;
+    uint64_t* map = (uint64_t*)mem_map (SLAB_MAP_WORDS * sizeof (uint64_t));
+    if (map == (void*)-1) {
+      mem_unmap (region, ARENA_RESERVE);
+      break;
+    }
+    arena* a = &arenas[num_arenas];
+    a->lo = region;
+    a->end = region + ARENA_RESERVE;
+    a->slab_map = map;
+    arena_reset (a);
+    __atomic_store_n (&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+  }
+  // decided under the lock, num_arenas is only read atomically outside it
+  arena* a = (i < num_arenas) ? &arenas[i] : &arenas[0];
+  pthread_mutex_unlock (&arenas_lock);
+  return a;
+}
+
+// set the size and flags of block p, keeping its prev-allocated bit
+static inline void set_block (void* p, int sz, int flags) {
+  hdr_store (p, sz | flags | (hdr_load (p) & PREV_ALLOC));
+}
+
+// tell the block after p, of size sz, whether p is allocated now
+static inline void set_next_prev (arena* a, void* p, int sz, int alloc) {
+  char* next = (char*)p + sz;
+  if (next - SIZE_T_SIZE >= a->brk) return;
+  // next may be allocated and owned by another thread, see hdr_load
+  if (alloc) hdr_store (next, hdr_load (next) | PREV_ALLOC);
+  else hdr_store (next, hdr_load (next) & ~PREV_ALLOC);
+}
+
+// first and second level index of the list holding blocks of size sz
+static inline void get_idx (int sz, int* fl, int* sl) {
+  int f = 31 - __builtin_clz (sz);
+  *fl = f;
+  *sl = (sz >> (f - SL_LOG2)) ^ SL_COUNT;
+}
+
+static inline uint32_t tree_prio (tnode* t) {
+  return (uint32_t)(((uintptr_t)t * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// whether block x of size xsz sorts before block y
+static inline int tree_less (tnode* x, int xsz, tnode* y) {
+  int ysz = size_of(y);
+  return xsz < ysz || (xsz == ysz && x < y);
+}
+
+static tnode* tree_insert (tnode* t, tnode* x, int sz) {
+  if (t == NULL) {
+    x->left = x->right = NULL;
+    return x;
+  }
+  if (tree_less (x, sz, t)) {
+    t->left = tree_insert (t->left, x, sz);
+    if (tree_prio (t->left) > tree_prio (t)) {
+      tnode* l = t->left;
+      t->left = l->right;
+      l->right = t;
+      return l;
+    }
+  } else {
+    t->right = tree_insert (t->right, x, sz);
+    if (tree_prio (t->right) > tree_prio (t)) {
+      tnode* r = t->right;
+      t->right = r->left;
+      r->left = t;
+      return r;
+    }
+  }
+  return t;
+}
+
+// join two treaps where every node of l sorts before every node of r
+static tnode* tree_merge (tnode* l, tnode* r) {
+  if (l == NULL) return r;
+  if (r == NULL) return l;
+  if (tree_prio (l) > tree_prio (r)) {
+    l->right = tree_merge (l->right, r);
+    return l;
+  }
+  r->left = tree_merge (l, r->left);
+  return r;
+}
+
+static tnode* tree_remove (tnode* t, tnode* x, int sz) {
+  if (t == NULL) return NULL;
+  if (t == x) return tree_merge (t->left, t->right);
+  if (tree_less (x, sz, t)) t->left = tree_remove (t->left, x, sz);
+  else t->right = tree_remove (t->right, x, sz);
+  return t;
+}
+
+// smallest block of at least sz bytes, the lowest one among equals
+static tnode* tree_best (tnode* t, int sz) {
+  tnode* best = NULL;
+  while (t != NULL) {
+    if (size_of(t) >= sz) {
+      best = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return best;
 }
 
 // insert new node at the start of free list
-void ins (void* p, int sz) {
+void ins (arena* a, void* p, int sz) {
 
-  int index = get_idx (sz);
-  *(int*)h(p) = sz;
+  set_block (p, sz, 0);
   *(int*)f(p,sz) = sz;
+  STAT(a->stats.bin_blocks[31 - __builtin_clz (sz)]++);
+  STAT(a->stats.bin_bytes[31 - __builtin_clz (sz)] += sz);
+  if (sz >= TREE_MIN) {
+    a->tree = tree_insert (a->tree, (tnode*)p, sz);
+    return;
+  }
+
+  int fl, sl;
+  get_idx (sz, &fl, &sl);
 
   node* new_node = (node*)p;
   new_node->prev = NULL;
-  new_node->next = freelists [index];
-  if (freelists [index] != NULL) freelists [index]->prev = new_node;
-  freelists [index] = new_node;
+  new_node->next = a->freelists [fl][sl];
+  if (a->freelists [fl][sl] != NULL) a->freelists [fl][sl]->prev = new_node;
+  a->freelists [fl][sl] = new_node;
+  a->fl_bitmap |= 1U << fl;
+  a->sl_bitmap [fl] |= 1U << sl;
 }
 
 // delete node from free list
-void del (node* p, int sz) {
+void del (arena* a, node* p, int sz) {
+  if (sz >= TREE_MIN) {
+    STAT(a->stats.bin_blocks[31 - __builtin_clz (sz)]--);
+    STAT(a->stats.bin_bytes[31 - __builtin_clz (sz)] -= sz);
+    a->tree = tree_remove (a->tree, (tnode*)p, sz);
+    return;
+  }
   
-  int index = get_idx (sz);
+  int fl, sl;
+  get_idx (sz, &fl, &sl);
   
-  if (freelists [index] == NULL || p == NULL) return;
+  if (a->freelists [fl][sl] == NULL || p == NULL) return;
+  STAT(a->stats.bin_blocks[fl]--);
+  STAT(a->stats.bin_bytes[fl] -= sz);
 
-  *(int*)f(p,sz) = -1;
-  
-  if (p == freelists [index]) freelists [index] = p -> next;
+  if (p == a->freelists [fl][sl]) {
+    a->freelists [fl][sl] = p -> next;
+    if (p->next == NULL) {
+      a->sl_bitmap [fl] &= ~(1U << sl);
+      if (a->sl_bitmap [fl] == 0) a->fl_bitmap &= ~(1U << fl);
+    }
+  }
 
   if (p->next != NULL) p->next->prev = p->prev;
 
@@ -130,84 +508,164 @@ void del (node* p, int sz) {
 }
 
 // given an aligned_size requested in malloc, return a node from a free list
-// first checks bin below and finds the minimum one thats bigger than the requested size
-// then checks next bigger bin and just gives first block
-node* best_fit (int sz) {
-  int index = get_idx (sz);
+// first looks at up to FIT_SCAN blocks of the request's own list, which may
+// hold blocks both smaller and bigger than sz, and keeps the smallest one
+// that fits. otherwise every block in the next non-empty list is big enough,
+// so the bitmaps give us one without looking at any list. large requests,
+// and small ones when every list is empty, take the best fit from the tree
+node* best_fit (arena* a, int sz) {
+  if (sz >= TREE_MIN) return (node*)tree_best (a->tree, sz);
+
+  int fl, sl;
+  get_idx (sz, &fl, &sl);
   node* ptr_node = NULL;
-  while (index<NUM_BINS) {
-    if (freelists [index]==NULL) {
-      index ++;
-      continue;
-    }
 
-    node* cur= freelists [index];
-    int mn = (1<<30);
-    while (cur != NULL) {
-      int cur_sz = *(int*)h(cur);
-      if (cur_sz >= sz && cur_sz < mn) {
-        mn = cur_sz;
-        ptr_node = cur;
-        if (mn == (1<<index)) break;
-      }
-      cur = cur->next;
+  node* cur = a->freelists [fl][sl];
+  int mn = 0;
+  for (int i = 0; cur != NULL && i < FIT_SCAN; i++) {
+    int cur_sz = size_of(cur);
+    if (cur_sz >= sz && (ptr_node == NULL || cur_sz < mn)) {
+      mn = cur_sz;
+      ptr_node = cur;
+      if (mn == sz) break;
     }
-    if (ptr_node) break;
-    index ++;
+    cur = cur->next;
+  }
+  if (ptr_node) return ptr_node;
+
+  uint32_t sl_map = (sl + 1 < SL_COUNT) ? a->sl_bitmap [fl] & (~0U << (sl + 1)) : 0;
+  if (sl_map == 0) {
+    uint32_t fl_map = (fl + 1 < FL_COUNT) ? a->fl_bitmap & (~0U << (fl + 1)) : 0;
+    if (fl_map == 0) return (node*)tree_best (a->tree, sz);
+    fl = __builtin_ctz (fl_map);
+    sl_map = a->sl_bitmap [fl];
   }
-  return ptr_node;
+  sl = __builtin_ctz (sl_map);
+  return a->freelists [fl][sl];
 }
 
-void* normal_sbrk (int aligned_size) {
-  void* p = mem_sbrk(aligned_size);
+void* normal_sbrk (arena* a, int aligned_size) {
+  void* p = arena_sbrk(a, aligned_size);
   
   if (p == (void*)-1) {
     return NULL;
   } else {
-    last = (void*)((char*)p + SIZE_T_SIZE);
+    // the first block of the arena has nothing before it to coalesce with
+    int prev = (a->last == NULL || (*(int*)h(a->last) & ALLOC)) ? PREV_ALLOC : 0;
+    a->last = (void*)((char*)p + SIZE_T_SIZE);
 
-    *(int*)p = aligned_size;
-    *(int*)((char*)p + aligned_size - SIZE_T_SIZE) = -1;
+    *(int*)p = aligned_size | ALLOC | prev;
     return (void*)((char*)p + SIZE_T_SIZE);
   }
 }
 
 // if last block in heap is free, expand that block rather than sbrk'ing the full requested size
-void* new_sbrk (int aligned_size) {
-  int sz = *(int*)h(last);
-  del (last,sz);
+void* new_sbrk (arena* a, int aligned_size) {
+  void* last = a->last;
+  int sz = size_of(last);
   int delta = aligned_size - sz;
-  void* p = mem_sbrk(delta);
+  if (arena_sbrk(a, delta) == (void*)-1) return NULL;
+  del (a,last,sz);
 
-  *(int*)h(last) = aligned_size;
-  *(int*)f(last,aligned_size) = -1;
+  set_block (last, aligned_size, ALLOC);
   return last;
 }
+// free blocks of at least PURGE_MIN bytes remember when they were last
+// freed in the word before their footer, or hold 0 once their pages have
+// been purged
+#define PURGE_MIN (64 * 1024)
+#define freed_at(p,sz) (*(uint64_t*)((char*)(p) + (sz) - 2*SIZE_T_SIZE - sizeof (uint64_t)))
+
+// milliseconds on a coarse monotonic clock, cheap enough to read on free
+static uint64_t now_ms (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the free block p of size sz ends the arena and has grown past
+// TRIM_THRESHOLD. keep half the threshold for the next requests and give the
+// rest back, returns the new size of the block
+static int heap_trim (arena* a, void* p, int sz) {
+  int page = (int)mem_pagesize ();
+  int decr = (sz - TRIM_THRESHOLD / 2) & ~(page - 1);
+  if (decr <= 0 || arena_shrink (a, decr) < 0) return sz;
+  return sz - decr;
+}
+
+// purge the pages of the blocks in tree t, of PURGE_MIN bytes and up, that
+// nobody has touched for PURGE_DECAY_MS. only the whole pages between the
+// tree links and the stamp are dropped, so the block stays in the tree and
+// keeps its boundary tags.
+static void tree_decay (tnode* t, uint64_t now, uintptr_t page) {
+  while (t != NULL) {
+    int sz = size_of(t);
+    if (sz < PURGE_MIN) {
+      // everything on the left is smaller still
+      t = t->right;
+      continue;
+    }
+    tree_decay (t->left, now, page);
+    uint64_t stamp = freed_at (t, sz);
+    if (stamp != 0 && now - stamp >= PURGE_DECAY_MS) {
+      uintptr_t lo = ((uintptr_t)(t + 1) + page - 1) & ~(page - 1);
+      uintptr_t hi = (uintptr_t)&freed_at (t, sz) & ~(page - 1);
+      if (hi > lo) mem_purge ((void*)lo, hi - lo);
+      freed_at (t, sz) = 0;
+    }
+    t = t->right;
+  }
+}
+
+// the scan runs at most every quarter of the decay time, and only from free,
+// so an idle arena keeps its pages until the next large free.
+static void heap_decay (arena* a, uint64_t now) {
+  if (now < a->decay_at) return;
+  a->decay_at = now + PURGE_DECAY_MS / 4;
+  tree_decay (a->tree, now, mem_pagesize ());
+}
+
 //  malloc - Allocate a block by incrementing the brk pointer.
 //  Always allocate a block whose size is a multiple of the alignment.
-void* my_malloc(size_t size) {
+//  Works directly on the arena's free lists, caller holds a->lock.
+static void* heap_malloc(arena* a, size_t size) {
+  if (size > HEAP_REQUEST_MAX) return NULL;
 
-  int aligned_size = ALIGN(size + 2 * SIZE_T_SIZE);
+  int aligned_size = ALIGN(size + SIZE_T_SIZE);
   if (aligned_size < MIN_BLOCK ) aligned_size = MIN_BLOCK;
 
-  node* ptr_node = best_fit (aligned_size);
+  if (aligned_size <= QUICK_MAX && a->quick[aligned_size / ALIGNMENT] != NULL) {
+    int cls = aligned_size / ALIGNMENT;
+    node* ptr = a->quick[cls];
+    a->quick[cls] = ptr->next;
+    a->quick_count[cls]--;
+    a->quick_blocks--;
+    return ptr;
+  }
+
+  node* ptr_node = best_fit (a, aligned_size);
+  if (ptr_node == NULL && a->quick_blocks > 0) {
+    heap_consolidate (a);
+    ptr_node = best_fit (a, aligned_size);
+  }
   if (ptr_node) {
-    int old_size = *(int*)h(ptr_node);
+    int old_size = size_of(ptr_node);
     int delta = old_size - aligned_size;
-    del (ptr_node,old_size);
+    del (a,ptr_node,old_size);
     void* ptr = (void*)ptr_node;
 
     if (delta >= MIN_BLOCK) {
       // split the block we found and free the extra portion
+      STAT(a->stats.splits++);
       void* new_ptr = (char*)ptr + aligned_size;
 
-      *(int*)h(ptr) = aligned_size;
-      *(int*)f(ptr,aligned_size) = -1;
+      set_block (ptr, aligned_size, ALLOC);
+      *(int*)h(new_ptr) = delta | ALLOC | PREV_ALLOC;
 
-      *(int*)h(new_ptr) = delta;
-      *(int*)f(ptr,old_size) = -1;
-
-      my_free (new_ptr);
+      heap_free (a, new_ptr);
+    } else {
+      set_block (ptr, old_size, ALLOC);
+      set_next_prev (a, ptr, old_size, 1);
     }
 
     return ptr;
@@ -215,81 +673,1014 @@ void* my_malloc(size_t size) {
 
   // round up amount we sbrk to 4096 to avoid repeated small sbrk calls
   if (aligned_size <= PERFECT_SIZE) {
-    void* ptr = normal_sbrk (PERFECT_SIZE);
-    my_free (ptr);
-    return my_malloc (size);
+    void* ptr = normal_sbrk (a, PERFECT_SIZE);
+    if (ptr == NULL) return NULL;
+    heap_free (a, ptr);
+    return heap_malloc (a, size);
   }
   
 
-  if (last == NULL) {
+  if (a->last == NULL) {
     // printf ("a ");
-    return normal_sbrk (aligned_size);
+    return normal_sbrk (a, aligned_size);
   }
   else {
     //printf("f\n");
-    int sz = *(int*)h(last);
-    //printf ("%d ",sz);
-    int is_free = *(int*)f(last,sz);
-    if (is_free>0) {
+    int is_free = !(*(int*)h(a->last) & ALLOC);
+    if (is_free) {
       // printf("a");
       //printf("g\n");
-      return new_sbrk (aligned_size);
+      return new_sbrk (a, aligned_size);
     } 
-    else return normal_sbrk (aligned_size);
+    else return normal_sbrk (a, aligned_size);
   }
   
 }
 
-void my_free(void* p) {
+// coalesce the blocks parked on quick list cls
+static void quick_flush (arena* a, int cls) {
+  node* p = a->quick[cls];
+  a->quick[cls] = NULL;
+  a->quick_blocks -= a->quick_count[cls];
+  a->quick_count[cls] = 0;
+  while (p != NULL) {
+    node* next = p->next;
+    heap_free (a, p);
+    p = next;
+  }
+}
+
+// coalesce every parked block. Caller holds a->lock.
+static void heap_consolidate (arena* a) {
+  for (int cls = 0; cls < QUICK_CLASSES && a->quick_blocks > 0; cls++) {
+    if (a->quick[cls] != NULL) quick_flush (a, cls);
+  }
+}
+
+// free a heap block, parking it on a quick list when it is small enough.
+// Caller holds a->lock.
+static void heap_quick_free (arena* a, void* p) {
+  int sz = size_of(p);
+  if (sz > QUICK_MAX) {
+    heap_free (a, p);
+    return;
+  }
+  int cls = sz / ALIGNMENT;
+  node* n = (node*)p;
+  n->next = a->quick[cls];
+  a->quick[cls] = n;
+  a->quick_blocks++;
+  if (++a->quick_count[cls] > QUICK_FILL) quick_flush (a, cls);
+}
+
+// free - Coalesce with free neighbours and put the result in a free list.
+// Caller holds a->lock.
+static void heap_free(arena* a, void* p) {
   if (p == NULL) return ;
-  if ( (uint64_t) p > (uint64_t)last) last = p ;
+  if ( (uint64_t) p > (uint64_t)a->last) a->last = p ;
   // printf ("my_Free in\n");
 
   node* cur = (node*)p;
-  int sz = *(int*)h(p);
+  int sz = size_of(p);
   int Tot1 = sz;
-  int flag_last = (p == last);
+  int flag_last = (p == a->last);
 
   // forward coalescing 
-  if (((char*)cur + Tot1) <= mem_heap_hi()){ 
+  if (((char*)cur + Tot1) < a->brk){ 
     node* goal = (node*)((char*)cur + Tot1);
-    sz = *(int*)h(goal);
-    int is_free = *(int*)(f(goal,sz));
-    if ( is_free > 0) {      
-      if (goal == last) flag_last = 1;
-      del (goal,sz);
+    sz = size_of(goal);
+    int is_free = !(*(int*)h(goal) & ALLOC);
+    if ( is_free && sz <= BLOCK_MAX - Tot1) {      
+      if (goal == a->last) flag_last = 1;
+      del (a,goal,sz);
       Tot1 += sz;
+      STAT(a->stats.coalesces++);
     }
   
   }
   
   int Tot2 = 0 ;
   
-  // backward coalescing
-  if ( ((char*)cur - Tot2 - 2*SIZE_T_SIZE) >= mem_heap_lo () ) {
-    int is_free = *(int*)((char*)cur - Tot2 - 2*SIZE_T_SIZE);
-    if ( is_free > 0 ) {
-      node* goal = (node*)((char*)cur - Tot2 - is_free);
-      int sz2 = *(int*)h(goal);
-      //if (sz2 != is_free) printf ("wergerg\n");
-      del(goal,sz2);
+  // backward coalescing, the footer of the block before is only there when
+  // it is free
+  if (!(*(int*)h(cur) & PREV_ALLOC)) {
+    int sz2 = *(int*)((char*)cur - 2*SIZE_T_SIZE);
+    if (sz2 <= BLOCK_MAX - Tot1) {
+      node* goal = (node*)((char*)cur - sz2);
+      del(a,goal,sz2);
       Tot2 += sz2;
+      STAT(a->stats.coalesces++);
     }
   }
 
   int Tot = Tot1 + Tot2;
   p = (char*)p - Tot2;
-  if (flag_last) last = p;
-  ins ((void*)p,Tot);
+  if (flag_last) a->last = p;
+  if (flag_last && Tot > TRIM_THRESHOLD) Tot = heap_trim (a, p, Tot);
+  ins (a,(void*)p,Tot);
+  set_next_prev (a, p, Tot, 0);
+
+  if (Tot >= PURGE_MIN) {
+    uint64_t now = now_ms ();
+    freed_at (p, Tot) = now;
+    heap_decay (a, now);
+  }
   // printf ("my_free out\n");
 }
 
+// split the block at p, total bytes and out of the bins, into up to n blocks
+// of aligned_size bytes. the last one keeps any slack too small to stand on
+// its own, anything more goes back to the free lists. Caller holds a->lock.
+static size_t heap_carve (arena* a, char* p, int total, int aligned_size, size_t n, void** out) {
+  size_t k = total / aligned_size;
+  if (k > n) k = n;
+  int rest = total - (int)k * aligned_size;
+  int last_size = aligned_size;
+  if (rest < MIN_BLOCK) {
+    last_size += rest;
+    rest = 0;
+  }
+
+  set_block (p, k == 1 ? last_size : aligned_size, ALLOC);
+  out[0] = p;
+  for (size_t i = 1; i < k; i++) {
+    char* q = p + i * aligned_size;
+    *(int*)h(q) = (i == k - 1 ? last_size : aligned_size) | ALLOC | PREV_ALLOC;
+    out[i] = q;
+  }
+  if (a->last == p) a->last = p + (k - 1) * aligned_size;
+
+  if (rest > 0) {
+    char* end = p + total - rest;
+    *(int*)h(end) = rest | ALLOC | PREV_ALLOC;
+    heap_free (a, end);
+  } else {
+    set_next_prev (a, p, total, 1);
+  }
+  return k;
+}
+
+// allocate up to n blocks for requests of size bytes, carving as many as
+// possible out of one free block, or out of one piece of new memory, instead
+// of looking for and splitting a block for each. returns how many were
+// allocated. Caller holds a->lock.
+static size_t heap_malloc_batch (arena* a, size_t size, size_t n, void** out) {
+  if (size > HEAP_REQUEST_MAX) return 0;
+  int aligned_size = ALIGN(size + SIZE_T_SIZE);
+  if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+
+  size_t done = 0;
+  while (done < n) {
+    size_t count = n - done;
+    if (count > BLOCK_MAX / aligned_size) count = BLOCK_MAX / aligned_size;
+    int want = (int)count * aligned_size;
+
+    char* p = (char*)best_fit (a, want);
+    int total = want;
+    if (p != NULL) {
+      total = size_of(p);
+      del (a, (node*)p, total);
+    } else if (a->last != NULL && !(*(int*)h(a->last) & ALLOC) && size_of(a->last) < want) {
+      p = (char*)new_sbrk (a, want);
+    } else {
+      p = (char*)normal_sbrk (a, want);
+    }
+    if (p == NULL) break;
+    done += heap_carve (a, p, total, aligned_size, n - done, out + done);
+  }
+
+  // no region was big enough and the arena cannot grow, so use up whatever
+  // smaller blocks are left one by one
+  while (done < n && (out[done] = heap_malloc (a, size)) != NULL) done++;
+  return done;
+}
+
+// allocate a block whose payload is aligned to align bytes. we take a block
+// big enough to hold an aligned payload plus a leading piece that can stand
+// on its own, then give the leading and trailing slack back to the free lists.
+// Caller holds a->lock.
+static void* heap_memalign (arena* a, size_t align, size_t size) {
+  if (align > HEAP_REQUEST_MAX / 2 || size > HEAP_REQUEST_MAX / 2) return NULL;
+  int aligned_size = ALIGN(size + SIZE_T_SIZE);
+  if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+
+  char* p = (char*)heap_malloc (a, aligned_size + align + MIN_BLOCK - SIZE_T_SIZE - ALIGNMENT);
+  if (p == NULL) return NULL;
+  int total = size_of(p);
+
+  char* q = (char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+  if (q != p && q - p < MIN_BLOCK) q += align;
+  int lead = q - p;
+  if (lead > 0) {
+    // q is the block after the leading piece now, freeing that piece
+    // clears q's prev-allocated bit
+    *(int*)h(q) = (total - lead) | ALLOC | PREV_ALLOC;
+    set_block (p, lead, ALLOC);
+    if (a->last == p) a->last = q;
+    heap_free (a, p);
+    total -= lead;
+  }
+
+  int delta = total - aligned_size;
+  if (delta >= MIN_BLOCK) {
+    void* new_ptr = q + aligned_size;
+    set_block (q, aligned_size, ALLOC);
+    *(int*)h(new_ptr) = delta | ALLOC | PREV_ALLOC;
+    STAT(a->stats.splits++);
+    heap_free (a, new_ptr);
+  }
+  return q;
+}
+
+#if MALLOC_STATS
+// size of the largest free block of a: the rightmost node of the tree, or
+// else the biggest block of the highest non-empty list. Caller holds a->lock.
+static size_t largest_free (arena* a) {
+  if (a->tree != NULL) {
+    tnode* t = a->tree;
+    while (t->right != NULL) t = t->right;
+    return size_of(t);
+  }
+  if (a->fl_bitmap == 0) return 0;
+  int fl = 31 - __builtin_clz (a->fl_bitmap);
+  int sl = 31 - __builtin_clz (a->sl_bitmap[fl]);
+  size_t mx = 0;
+  for (node* n = a->freelists[fl][sl]; n != NULL; n = n->next) {
+    if ((size_t)size_of(n) > mx) mx = size_of(n);
+  }
+  return mx;
+}
+
+// add up the counters of every arena, one lock at a time, so the totals
+// are each consistent per arena but not across all of them
+void my_malloc_stats(my_malloc_stats_t* st) {
+  memset (st, 0, sizeof (*st));
+  int n = __atomic_load_n (&num_arenas, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; i++) {
+    arena* a = &arenas[i];
+    pthread_mutex_lock (&a->lock);
+    st->heap_bytes += a->brk - a->lo;
+    for (int b = 0; b < FL_COUNT && b < MY_STATS_BINS; b++) {
+      st->bin_blocks[b] += a->stats.bin_blocks[b];
+      st->bin_bytes[b] += a->stats.bin_bytes[b];
+      st->free_bytes += a->stats.bin_bytes[b];
+    }
+    size_t mx = largest_free (a);
+    if (mx > st->largest_free) st->largest_free = mx;
+    st->sbrk_calls += a->stats.sbrk_calls;
+    st->splits += a->stats.splits;
+    st->coalesces += a->stats.coalesces;
+    pthread_mutex_unlock (&a->lock);
+  }
+  st->allocated_bytes = st->heap_bytes - st->free_bytes;
+  st->mmapped_bytes = __atomic_load_n (&stats.mmapped_bytes, __ATOMIC_RELAXED);
+  st->mmap_calls = __atomic_load_n (&stats.mmap_calls, __ATOMIC_RELAXED);
+  st->munmap_calls = __atomic_load_n (&stats.munmap_calls, __ATOMIC_RELAXED);
+  st->mremap_calls = __atomic_load_n (&stats.mremap_calls, __ATOMIC_RELAXED);
+  st->realloc_in_place = __atomic_load_n (&stats.realloc_in_place, __ATOMIC_RELAXED);
+  st->realloc_copy = __atomic_load_n (&stats.realloc_copy, __ATOMIC_RELAXED);
+}
+#endif
+
+// check - This checks our invariants for every arena: the headers chain
+// from the first block to the end of the region, every block knows whether
+// the block before it is allocated, free blocks carry their size in their
+// footer, and no two free blocks that could be one are left next to each
+// other.
+int my_check() {
+  for (int i = 0; i < num_arenas; i++) {
+    arena* a = &arenas[i];
+    char* p = a->lo + 12 + SIZE_T_SIZE;
+    int prev_alloc = 1;
+    int prev_size = 0;
+    int size = 0;
+    size_t free_bytes = 0;
+
+    while (p - SIZE_T_SIZE < a->brk) {
+      int tag = *(int*)h(p);
+      size = tag & ~TAG_BITS;
+      if (size < MIN_BLOCK || p - SIZE_T_SIZE + size > a->brk) {
+        printf("Bad block size %d at %p in arena %d\n", size, p, i);
+        return -1;
+      }
+      if (!(tag & PREV_ALLOC) != !prev_alloc) {
+        printf("Bad prev-allocated bit at %p in arena %d\n", p, i);
+        return -1;
+      }
+      if (!(tag & ALLOC)) {
+        if (*(int*)f(p,size) != size) {
+          printf("Free block %p has footer %d, size %d\n", p, *(int*)f(p,size), size);
+          return -1;
+        }
+        if (!prev_alloc && prev_size + size <= BLOCK_MAX) {
+          printf("Free blocks before %p were not coalesced\n", p);
+          return -1;
+        }
+        free_bytes += size;
+      }
+      prev_alloc = tag & ALLOC;
+      prev_size = size;
+      p += size;
+    }
+
+    if (p - SIZE_T_SIZE != a->brk) {
+      printf("Bad headers did not end at the end of arena %d!\n", i);
+      printf("lo: %p, brk: %p, size: %d, p: %p\n", a->lo, a->brk, size, p);
+      return -1;
+    }
+#if MALLOC_STATS
+    size_t counted = 0;
+    for (int b = 0; b < FL_COUNT; b++) counted += a->stats.bin_bytes[b];
+    if (counted != free_bytes) {
+      printf("Arena %d has %zu free bytes but counted %zu\n", i, free_bytes, counted);
+      return -1;
+    }
+#endif
+  }
+
+  return 0;
+}
+
+// whether p is a slot in one of the arena's slab runs
+static inline int slab_owns (arena* a, void* p) {
+  if (SLAB_MAX == 0) return 0;
+  size_t bit = slab_bit (a, p);
+  if (bit >= SLAB_MAP_WORDS * 64) return 0;
+  // my_free asks without the lock, so the map words are only touched atomically
+  return (__atomic_load_n (&a->slab_map[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
+static void slab_link (arena* a, slab_run* run) {
+  int cls = run->slot / ALIGNMENT;
+  run->prev = NULL;
+  run->next = a->slabs[cls];
+  if (run->next != NULL) run->next->prev = run;
+  a->slabs[cls] = run;
+}
+
+static void slab_unlink (arena* a, slab_run* run) {
+  int cls = run->slot / ALIGNMENT;
+  if (a->slabs[cls] == run) a->slabs[cls] = run->next;
+  if (run->next != NULL) run->next->prev = run->prev;
+  if (run->prev != NULL) run->prev->next = run->next;
+}
+
+// hand out a slot of class cls, starting a new run when none has room. a
+// class only gets runs once it has seen SLAB_HOT runs worth of requests
+// from the heap, since a run pinned for a handful of objects costs more
+// than their headers save. Returns NULL to send the request to the heap.
+// Caller holds a->lock.
+static void* slab_malloc (arena* a, int cls) {
+  slab_run* run = a->slabs[cls];
+  if (run == NULL) {
+    int capacity = (SLAB_RUN_SIZE - SLAB_HEADER) / (cls * ALIGNMENT);
+    if (a->slab_seen[cls] < SLAB_HOT * capacity) {
+      a->slab_seen[cls]++;
+      return NULL;
+    }
+    run = (slab_run*)heap_memalign (a, SLAB_PAGE, SLAB_RUN_SIZE);
+    if (run == NULL) return NULL;
+    size_t bit = slab_bit (a, run);
+    if (bit >= SLAB_MAP_WORDS * 64) {
+      heap_free (a, run);
+      return NULL;
+    }
+    __atomic_fetch_or (&a->slab_map[bit / 64], 1UL << (bit % 64), __ATOMIC_RELAXED);
+    run->slot = cls * ALIGNMENT;
+    run->used = 0;
+    run->capacity = (SLAB_RUN_SIZE - SLAB_HEADER) / run->slot;
+    run->free = NULL;
+    run->bump = (char*)run + SLAB_HEADER;
+    slab_link (a, run);
+  }
+
+  void* p = run->free;
+  if (p != NULL) {
+    run->free = *(void**)p;
+  } else {
+    p = run->bump;
+    run->bump += run->slot;
+  }
+  if (++run->used == run->capacity) slab_unlink (a, run);
+  return p;
+}
+
+// give slot p back to its run. an empty run goes back to the free lists
+// unless it is the only run of its class with room left. Caller holds a->lock.
+static void slab_free (arena* a, void* p) {
+  slab_run* run = run_of (p);
+  *(void**)p = run->free;
+  run->free = p;
+  if (run->used-- == run->capacity) slab_link (a, run);
+  if (run->used == 0 && (run->next != NULL || run->prev != NULL)) {
+    slab_unlink (a, run);
+    size_t bit = slab_bit (a, run);
+    __atomic_fetch_and (&a->slab_map[bit / 64], ~(1UL << (bit % 64)), __ATOMIC_RELAXED);
+    heap_free (a, run);
+  }
+}
+
+// requests of MMAP_THRESHOLD bytes and up get a mapping of their own, so
+// freeing them hands the pages straight back to the os and they never split
+// the heap. the ALIGNMENT bytes before the payload hold the mapping length,
+// the gap between the start of the mapping and that length word, which is
+// only non-zero for aligned blocks, and a tag that is just MMAPPED, which no
+// heap block size can be since sizes are multiples of ALIGNMENT.
+#define MMAPPED 0x4
+
+// length of the mapping holding mmapped block p
+#define mmap_len(p) (*(size_t*)((char*)(p) - ALIGNMENT))
+
+// bytes between the start of the mapping and the length word
+#define mmap_lead(p) (*(int*)((char*)(p) - 2 * SIZE_T_SIZE))
+
+#define mmap_base(p) ((char*)(p) - ALIGNMENT - mmap_lead(p))
+
+static inline int is_mmapped (void* p) {
+  return hdr_load (p) & MMAPPED;
+}
+
+static size_t mmap_length (size_t size) {
+  size_t page = mem_pagesize ();
+  return (size + ALIGNMENT + page - 1) & ~(page - 1);
+}
+
+// map a block whose payload is aligned to align bytes. the mapping has room
+// for the worst placement, and the whole pages it does not need on either
+// side are unmapped again.
+static void* mmap_memalign (size_t align, size_t size) {
+  if (align > BLOCK_MAX || size > SIZE_MAX - mem_pagesize () - align) return NULL;
+  size_t len = mmap_length (size + align - ALIGNMENT);
+  char* base = (char*)mem_map (len);
+  if (base == (void*)-1) return NULL;
+  STAT_ADD(stats.mmap_calls, 1);
+  char* p = (char*)(((uintptr_t)base + ALIGNMENT + align - 1) & ~(uintptr_t)(align - 1));
+
+  uintptr_t page = mem_pagesize ();
+  char* start = (char*)((uintptr_t)(p - ALIGNMENT) & ~(page - 1));
+  char* end = base + mmap_length (p + size - ALIGNMENT - base);
+  if (start > base) mem_unmap (base, start - base);
+  if (base + len > end) mem_unmap (end, base + len - end);
+  len = end - start;
+  base = start;
+  STAT_ADD(stats.mmapped_bytes, len);
+
+  mmap_len(p) = len;
+  mmap_lead(p) = p - ALIGNMENT - base;
+  *(int*)h(p) = MMAPPED | ALLOC;
+  return p;
+}
+
+static inline void* mmap_malloc (size_t size) {
+  return mmap_memalign (ALIGNMENT, size);
+}
+
+static void mmap_free (void* p) {
+  STAT_ADD(stats.munmap_calls, 1);
+  STAT_ADD(stats.mmapped_bytes, -mmap_len (p));
+  mem_unmap (mmap_base (p), mmap_len (p));
+}
+
+// let the kernel move the pages instead of copying them
+static void* mmap_realloc (void* p, size_t size) {
+  int lead = mmap_lead(p);
+  if (size > SIZE_MAX - ALIGNMENT - mem_pagesize () - lead) return NULL;
+  size_t len = mmap_length (size + lead);
+  size_t old_len = mmap_len (p);
+  char* base = (char*)mem_remap (mmap_base (p), old_len, len);
+  if (base == (void*)-1) return NULL;
+  STAT_ADD(stats.mremap_calls, 1);
+  STAT_ADD(stats.mmapped_bytes, len - old_len);
+  p = base + lead + ALIGNMENT;
+  mmap_len(p) = len;
+  return p;
+}
+
+// free a block that may be a slab slot. Caller holds a->lock.
+static inline void arena_free (arena* a, void* p) {
+  if (slab_owns (a, p)) slab_free (a, p);
+  else heap_quick_free (a, p);
+}
+
+// the arena the calling thread allocates from, assigned on first use
+static inline arena* thread_arena (void) {
+  if (tc.arena == NULL) tc.arena = arena_assign ();
+  return tc.arena;
+}
+
+// a thread freeing a block of an arena it does not allocate from pushes it
+// on the arena's remote list with a compare and swap instead of taking the
+// lock, so a thread that frees what another one allocated never waits for
+// it. the list is taken whole by the next thread holding the lock, which
+// makes it safe against ABA with any number of pushers.
+static inline void remote_push (arena* a, void* p) {
+  node* n = (node*)p;
+  node* head = __atomic_load_n (&a->remote, __ATOMIC_RELAXED);
+  do {
+    n->next = head;
+  } while (!__atomic_compare_exchange_n (&a->remote, &head, n, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// free the blocks other threads pushed on a's remote list. Caller holds a->lock.
+static void remote_drain (arena* a) {
+  if (__atomic_load_n (&a->remote, __ATOMIC_RELAXED) == NULL) return;
+  node* n = __atomic_exchange_n (&a->remote, NULL, __ATOMIC_ACQUIRE);
+  while (n != NULL) {
+    node* next = n->next;
+    arena_free (a, n);
+    n = next;
+  }
+}
+
+// take a's lock and catch up on the frees other threads left for it
+static inline void arena_lock (arena* a) {
+  pthread_mutex_lock (&a->lock);
+  remote_drain (a);
+}
+
+// one block for a request of size bytes, from a slab run when it is small
+// enough. Caller holds a->lock.
+static inline void* arena_alloc (arena* a, size_t size) {
+  if (size <= SLAB_MAX) {
+    void* p = slab_malloc (a, (size == 0) ? 1 : ALIGN(size) / ALIGNMENT);
+    if (p != NULL) return p;
+  }
+  return heap_malloc (a, size);
+}
+
+// allocate from the calling thread's arena, falling back to arena 0 when the
+// thread's reserved region is full
+static void* arena_malloc (size_t size) {
+  arena* a = thread_arena ();
+  arena_lock (a);
+  void* p = arena_alloc (a, size);
+  pthread_mutex_unlock (&a->lock);
+  if (p == NULL && a != &arenas[0]) {
+    a = &arenas[0];
+    arena_lock (a);
+    p = arena_alloc (a, size);
+    pthread_mutex_unlock (&a->lock);
+  }
+  return p;
+}
+
+// give up to n cached blocks of a class back to the arenas they came from.
+// blocks allocated by another thread may belong to a different arena than
+// ours, and go on that arena's remote list.
+static void tcache_release (int cls, int n) {
+  arena* locked = NULL;
+  for (int i = 0; i < n && tc.head[cls] != NULL; i++) {
+    node* p = tc.head[cls];
+    tc.head[cls] = p->next;
+    tc.count[cls]--;
+    arena* a = arena_of (p);
+    if (a != tc.arena) {
+      remote_push (a, p);
+      continue;
+    }
+    if (locked == NULL) {
+      arena_lock (a);
+      locked = a;
+    }
+    arena_free (a, p);
+  }
+  if (locked != NULL) pthread_mutex_unlock (&locked->lock);
+}
+
+// return every block cached by this thread to the shared free lists
+static void tcache_flush (void* arg) {
+  for (int cls = 0; cls < TCACHE_CLASSES; cls++) {
+    tcache_release (cls, tc.count[cls]);
+  }
+}
+
+static void tcache_key_init (void) {
+  pthread_key_create (&tcache_key, tcache_flush);
+}
+
+// the cache for this class is empty, fetch a batch of blocks of the class
+// size under one lock and hand out the last one. the batch starts at one and
+// doubles on every refill, so classes that are rarely used do not pin memory.
+static void* tcache_refill (int cls, size_t size) {
+  if (!tc.registered) {
+    tc.registered = 1;
+    pthread_once (&tcache_key_once, tcache_key_init);
+    pthread_setspecific (tcache_key, &tc);
+  }
+  int n = tc.batch[cls] ? tc.batch[cls] : 1;
+  tc.batch[cls] = (2 * n < TCACHE_BATCH) ? 2 * n : TCACHE_BATCH;
+
+  arena* a = thread_arena ();
+  arena_lock (a);
+  void* ptr = arena_alloc (a, size);
+  for (int i = 1; i < n && ptr != NULL; i++) {
+    node* extra = (node*)arena_alloc (a, size);
+    if (extra == NULL) break;
+    extra->next = tc.head[cls];
+    tc.head[cls] = extra;
+    tc.count[cls]++;
+  }
+  pthread_mutex_unlock (&a->lock);
+  if (ptr == NULL) return arena_malloc (size);
+  return ptr;
+}
+
+// small requests are served from this thread's cache without touching the
+// arenas; everything else takes the lock of the thread's arena. slab slots
+// are cached by slot size and heap blocks by block size, and heap blocks
+// never get cached at or below SLAB_MAX, so the two kinds never share a class.
+void* my_malloc(size_t size) {
+  int cls;
+  size_t class_size;
+  if (size <= SLAB_MAX) {
+    cls = (size == 0) ? 1 : ALIGN(size) / ALIGNMENT;
+    class_size = cls * ALIGNMENT;
+  } else {
+    if (size > HEAP_REQUEST_MAX) return mmap_malloc (size);
+    int aligned_size = ALIGN(size + SIZE_T_SIZE);
+    if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+    cls = aligned_size / ALIGNMENT;
+    class_size = aligned_size - SIZE_T_SIZE;
+  }
+
+  if (cls < TCACHE_CLASSES) {
+    node* p = tc.head[cls];
+    if (p != NULL) {
+      tc.head[cls] = p->next;
+      tc.count[cls]--;
+      return p;
+    }
+    // refill with blocks of exactly the class size
+    return tcache_refill (cls, class_size);
+  }
+
+  if (size >= MMAP_THRESHOLD) {
+    void* p = mmap_malloc (size);
+    if (p != NULL) return p;
+  }
+  return arena_malloc (size);
+}
+
+// cache p in this thread's class cls, or give it straight back to its arena
+// when it has no class
+static inline void release (arena* a, void* p, int cls) {
+  if (cls > 0 && cls < TCACHE_CLASSES) {
+    node* n = (node*)p;
+    n->next = tc.head[cls];
+    tc.head[cls] = n;
+    // the cache for this class is full, give a batch back to the arenas
+    if (++tc.count[cls] > TCACHE_FILL) tcache_release (cls, TCACHE_BATCH);
+    return;
+  }
+  if (a != tc.arena) {
+    remote_push (a, p);
+    return;
+  }
+
+  arena_lock (a);
+  arena_free (a, p);
+  pthread_mutex_unlock (&a->lock);
+}
+
+void my_free(void* p) {
+  if (p == NULL) return;
+
+  arena* a = arena_of (p);
+  int cls = 0;
+  if (slab_owns (a, p)) {
+    cls = run_of (p)->slot / ALIGNMENT;
+  } else {
+    int sz = hdr_load (p);
+    if (sz & MMAPPED) {
+      mmap_free (p);
+      return;
+    }
+    sz &= ~TAG_BITS;
+    if (sz > SLAB_MAX) cls = sz / ALIGNMENT;
+  }
+  release (a, p, cls);
+}
+
+// fill out with up to n blocks of size bytes and return how many there are.
+// cached blocks go first, then the rest comes from the thread's arena under
+// a single lock, carved next to each other out of as few regions as possible
+size_t my_malloc_batch(size_t size, size_t n, void** out) {
+  size_t done = 0;
+  if (size < MMAP_THRESHOLD) {
+    int cls = 0;
+    if (size <= SLAB_MAX) {
+      cls = (size == 0) ? 1 : ALIGN(size) / ALIGNMENT;
+    } else if (size <= TCACHE_MAX) {
+      int aligned_size = ALIGN(size + SIZE_T_SIZE);
+      cls = (aligned_size < MIN_BLOCK ? MIN_BLOCK : aligned_size) / ALIGNMENT;
+    }
+    if (cls < TCACHE_CLASSES) {
+      while (done < n && tc.head[cls] != NULL) {
+        out[done++] = tc.head[cls];
+        tc.head[cls] = tc.head[cls]->next;
+        tc.count[cls]--;
+      }
+    }
+
+    arena* a = thread_arena ();
+    arena_lock (a);
+    if (size <= SLAB_MAX) {
+      while (done < n && (out[done] = slab_malloc (a, cls)) != NULL) done++;
+    } else {
+      done += heap_malloc_batch (a, size, n - done, out + done);
+    }
+    pthread_mutex_unlock (&a->lock);
+  }
+
+  // mapped sizes, or the thread's arena is full
+  while (done < n && (out[done] = my_malloc (size)) != NULL) done++;
+  return done;
+}
+
+static int ptr_cmp (const void* x, const void* y) {
+  uintptr_t a = *(const uintptr_t*)x;
+  uintptr_t b = *(const uintptr_t*)y;
+  return (a > b) - (a < b);
+}
+
+// free n blocks at once, reordering ptrs by address on the way. blocks that
+// sit next to each other are folded into one before they reach the bins, so
+// a run of neighbours costs a single coalesce and insert. the batch goes
+// straight to the arenas, taking each arena's lock once per stretch of its
+// blocks.
+void my_free_batch(void** ptrs, size_t n) {
+  qsort (ptrs, n, sizeof (void*), ptr_cmp);
+
+  arena* locked = NULL;
+  size_t i = 0;
+  while (i < n) {
+    char* p = (char*)ptrs[i++];
+    if (p == NULL) continue;
+    arena* a = arena_of (p);
+    if (!slab_owns (a, p) && is_mmapped (p)) {
+      mmap_free (p);
+      continue;
+    }
+    if (a != locked) {
+      if (locked != NULL) pthread_mutex_unlock (&locked->lock);
+      pthread_mutex_lock (&a->lock);
+      locked = a;
+    }
+    if (slab_owns (a, p)) {
+      slab_free (a, p);
+      continue;
+    }
+
+    int sz = size_of(p);
+    int folded = 0;
+    while (i < n && (char*)ptrs[i] == p + sz && p + sz - SIZE_T_SIZE < a->brk
+           && size_of(ptrs[i]) <= BLOCK_MAX - sz) {
+      if (ptrs[i] == a->last) a->last = p;
+      sz += size_of(ptrs[i++]);
+      folded = 1;
+      STAT(a->stats.coalesces++);
+    }
+    if (folded) {
+      set_block (p, sz, ALLOC);
+      heap_free (a, p);
+    } else {
+      heap_quick_free (a, p);
+    }
+  }
+  if (locked != NULL) pthread_mutex_unlock (&locked->lock);
+}
+
+// bytes the caller may use at p, which can be more than it asked for
+size_t my_malloc_usable_size(void* p) {
+  if (p == NULL) return 0;
+  arena* a = arena_of (p);
+  if (slab_owns (a, p)) return run_of (p)->slot;
+  if (is_mmapped (p)) return mmap_len (p) - ALIGNMENT - mmap_lead (p);
+  return size_of(p) - SIZE_T_SIZE;
+}
+
+// a my_free_sized hint that doesn't fit its block means the caller's size
+// bookkeeping is broken. trusting it would cache a block under the wrong
+// class, or a mapping in the heap, so stop before the heap is corrupted.
+static void check_size_hint (void* p, size_t size) {
+  int mapped = !slab_owns (arena_of (p), p) && is_mmapped (p);
+  if (size <= my_malloc_usable_size (p) && (!mapped || size >= MMAP_THRESHOLD)) {
+    return;
+  }
+  fprintf (stderr, "mymalloc: free_sized(%p, %zu) does not match the block\n",
+           p, size);
+  abort ();
+}
+
+// free p knowing it was allocated, or last resized, with size bytes. below
+// MMAP_THRESHOLD a block cannot be mapped, so a heap block's class follows
+// from the size without reading its header, and above SLAB_MAX it cannot be
+// a slab slot either. the block may be bigger than the class, which only
+// means it is handed out for smaller requests. the hint is only checked
+// against the block with FREE_SIZED_CHECK.
+void my_free_sized(void* p, size_t size) {
+  if (p == NULL) return;
+  if (FREE_SIZED_CHECK) check_size_hint (p, size);
+  if (size >= MMAP_THRESHOLD) {
+    my_free (p);
+    return;
+  }
+
+  arena* a = arena_of (p);
+  int cls = 0;
+  if (size <= SLAB_MAX && slab_owns (a, p)) {
+    cls = run_of (p)->slot / ALIGNMENT;
+  } else {
+    int aligned_size = ALIGN(size + SIZE_T_SIZE);
+    if (aligned_size > SLAB_MAX) cls = aligned_size / ALIGNMENT;
+  }
+  release (a, p, cls);
+}
+
+// first byte of the arena's region that has never been handed out, so it
+// still reads as zero. Caller holds a->lock.
+static inline char* arena_fresh (arena* a) {
+  if (a == &arenas[0]) return (char*)mem_heap_fresh ();
+  return (a->fresh > a->lo) ? a->fresh : a->lo;
+}
+
+// clear n bytes at p. large ranges are written with non-temporal stores so
+// that clearing them does not push everything else out of the caches.
+static void zero (void* p, size_t n) {
+#ifdef __SSE2__
+  if (n >= CALLOC_STREAM_MIN) {
+    char* c = (char*)p;
+    size_t head = -(uintptr_t)c & 15;
+    memset (c, 0, head);
+    c += head;
+    n -= head;
+    __m128i z = _mm_setzero_si128 ();
+    for (char* end = c + (n & ~(size_t)63); c < end; c += 64) {
+      _mm_stream_si128 ((__m128i*)c, z);
+      _mm_stream_si128 ((__m128i*)(c + 16), z);
+      _mm_stream_si128 ((__m128i*)(c + 32), z);
+      _mm_stream_si128 ((__m128i*)(c + 48), z);
+    }
+    _mm_sfence ();
+    memset (c, 0, n & 63);
+    return;
+  }
+#endif
+  memset (p, 0, n);
+}
+
+// small requests take the thread cache and clear the block. larger ones
+// come straight from an arena, recording where its never used memory began.
+// the part of the block past that point was only written during this very
+// call: the header of the block that grew the arena, and while the block sat
+// in a bin, list or tree links at its start and a footer and decay stamp at
+// its end. fresh mappings are zero throughout.
+void* my_calloc(size_t count, size_t size) {
+  size_t n;
+  if (__builtin_mul_overflow (count, size, &n)) return NULL;
+
+  if (n <= TCACHE_MAX) {
+    void* p = my_malloc (n);
+    if (p != NULL) memset (p, 0, n);
+    return p;
+  }
+  if (n >= MMAP_THRESHOLD || n > HEAP_REQUEST_MAX) {
+    void* p = mmap_malloc (n);
+    if (p != NULL || n > HEAP_REQUEST_MAX) return p;
+  }
+
+  arena* a = thread_arena ();
+  arena_lock (a);
+  char* fresh = arena_fresh (a);
+  char* p = (char*)arena_alloc (a, n);
+  pthread_mutex_unlock (&a->lock);
+  if (p == NULL && a != &arenas[0]) {
+    a = &arenas[0];
+    arena_lock (a);
+    fresh = arena_fresh (a);
+    p = (char*)arena_alloc (a, n);
+    pthread_mutex_unlock (&a->lock);
+  }
+  if (p == NULL) return NULL;
+
+  // the header of a block added at the old end counts as written too, since
+  // that block may have been coalesced into ours
+  fresh += SIZE_T_SIZE;
+  size_t dirty = (p < fresh) ? (size_t)(fresh - p) : 0;
+  size_t meta = 2 * sizeof (tnode);
+  if (dirty >= n || n - dirty <= 2 * meta) {
+    zero (p, n);
+  } else {
+    zero (p, dirty > meta ? dirty : meta);
+    memset (p + n - meta, 0, meta);
+  }
+  return p;
+}
+
+// aligned blocks come from a mapping of their own when they are large, and
+// are otherwise cut out of the heap of the calling thread's arena, with the
+// slack on both sides going back to the free lists. alignments of ALIGNMENT
+// and below are what my_malloc gives anyway.
+void* my_memalign(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+  if (alignment <= ALIGNMENT) return my_malloc (size);
+
+  if (size >= MMAP_THRESHOLD || size > HEAP_REQUEST_MAX / 2) {
+    void* p = mmap_memalign (alignment, size);
+    if (p != NULL || size > HEAP_REQUEST_MAX / 2) return p;
+  }
+
+  arena* a = thread_arena ();
+  arena_lock (a);
+  void* p = heap_memalign (a, alignment, size);
+  pthread_mutex_unlock (&a->lock);
+  if (p == NULL && a != &arenas[0]) {
+    // this arena's region is full, share the brk heap
+    a = &arenas[0];
+    arena_lock (a);
+    p = heap_memalign (a, alignment, size);
+    pthread_mutex_unlock (&a->lock);
+  }
+  return p;
+}
+
+// in-place resizing happens under the owning arena's lock; when the block
+// needs a new home we drop the lock and go through my_malloc and my_free like any
+// other caller.
+static void* heap_realloc(arena* a, void* ptr, size_t size);
 
 void* my_realloc(void* ptr, size_t size) {
   if (!ptr) return my_malloc(size);
 
-  int old_size = *(int*)h(ptr);
-  int new_size = ALIGN(size + 2 * SIZE_T_SIZE);
+  arena* a = arena_of (ptr);
+  void* newptr;
+  size_t copy_size;
+
+  if (slab_owns (a, ptr)) {
+    // slots cannot grow, but any size up to the slot fits in place
+    copy_size = run_of (ptr)->slot;
+    if (size <= copy_size) {
+      STAT_ADD(stats.realloc_in_place, 1);
+      return ptr;
+    }
+  } else if (is_mmapped (ptr)) {
+    // a block shrunk below MMAP_THRESHOLD moves into the heap, so that
+    // my_free_sized never sees a small mapped block
+    if (size >= MMAP_THRESHOLD) {
+      newptr = mmap_realloc (ptr, size);
+      if (newptr != NULL) {
+        STAT_ADD(stats.realloc_in_place, 1);
+        return newptr;
+      }
+    }
+    copy_size = mmap_len (ptr) - ALIGNMENT - mmap_lead (ptr);
+  } else {
+    if (size <= HEAP_REQUEST_MAX) {
+      pthread_mutex_lock (&a->lock);
+      newptr = heap_realloc (a, ptr, size);
+      pthread_mutex_unlock (&a->lock);
+      if (newptr != NULL) {
+        STAT_ADD(stats.realloc_in_place, 1);
+        return newptr;
+      }
+    }
+    // Get the size of the old block of memory from its header.
+    copy_size = size_of(ptr) - SIZE_T_SIZE;
+  }
+
+  // Allocate a new chunk of memory, and fail if that allocation fails.
+  newptr = my_malloc(size);
+  if (NULL == newptr) {
+    return NULL;
+  }
+
+  // If the new block is smaller than the old one, we have to stop copying
+  // early so that we don't write off the end of the new block of memory.
+  if (size < copy_size) {
+    copy_size = size;
+  }
+
+  // This is a standard library call that performs a simple memory copy.
+  memcpy(newptr, ptr, copy_size);
+  STAT_ADD(stats.realloc_copy, 1);
+
+  // Release the old block.
+  my_free(ptr);
+
+  // Return a pointer to the new block.
+  return newptr;
+}
+
+// try to resize ptr in place, growing into the free blocks around it, returns
+// NULL if it needs a new block. the payload only moves when the block before
+// is absorbed, and then with a memmove within the same stretch of heap.
+// Caller holds a->lock.
+static void* heap_realloc(arena* a, void* ptr, size_t size) {
+
+  int old_size = size_of(ptr);
+  int new_size = ALIGN(size + SIZE_T_SIZE);
+  if (new_size < MIN_BLOCK) new_size = MIN_BLOCK;
   
   if (old_size >= new_size) {
     // dont malloc anything new, just shorten given block
@@ -298,90 +1689,89 @@ void* my_realloc(void* ptr, size_t size) {
     // if newly free portion is big enough, put it in free list
     void* new_ptr = (char*)ptr + new_size;
 
-    *(int*)h(new_ptr) = delta;
-    *(int*)f(ptr,old_size) = -1;
-
-    *(int*)h(ptr) = new_size;
-    *(int*)f(ptr,new_size) = -1;
-    
+    set_block (ptr, new_size, ALLOC);
+    *(int*)h(new_ptr) = delta | ALLOC | PREV_ALLOC;
+    STAT(a->stats.splits++);
 
-    my_free (new_ptr);
+    heap_free (a, new_ptr);
     return ptr;
   }
-  if (ptr == last) {
+  if (ptr == a->last) {
     // if we are reallocing the last block in our heap, just expand heap size by delta
     int delta = new_size - old_size;
-    mem_sbrk(delta);
-    *(int*)h(ptr) = new_size;
-    *(int*)f(ptr,new_size) = -1;
+    if (arena_sbrk(a, delta) == (void*)-1) return NULL;
+    set_block (ptr, new_size, ALLOC);
     return ptr;
   }
-  if ( ((char*)ptr + old_size) <= mem_heap_hi() ) { 
+  if ( ((char*)ptr + old_size) < a->brk ) { 
     // check if the block to the right of ptr is free, try to combine two blocks instead of mallocing new block
     node* goal = (node*)((char*)ptr + old_size);
-    int next_sz = *(int*)h(goal);
-    int is_free = *(int*)(f(goal,next_sz));
-    if ( is_free > 0 && old_size + next_sz >= new_size ) {
-      if (goal == last) last = ptr;
-      del (goal,next_sz);
-      int delta = (old_size + next_sz) - new_size;
+    int next_sz = size_of(goal);
+    int is_free = !(*(int*)h(goal) & ALLOC);
+    if ( is_free && next_sz >= new_size - old_size ) {
+      if (goal == a->last) a->last = ptr;
+      del (a,goal,next_sz);
+      int delta = next_sz - (new_size - old_size);
       if (delta < MIN_BLOCK) {
-        *(int*)h(ptr) = old_size + next_sz;
+        set_block (ptr, old_size + next_sz, ALLOC);
+        set_next_prev (a, ptr, old_size + next_sz, 1);
         return ptr;
       }
       // when combining the two blocks, free extra portion if its big enough
       void* new_ptr = (char*)ptr + new_size;
 
-      *(int*)h(new_ptr) = delta;
-      *(int*)f(ptr,old_size) = -1;
+      set_block (ptr, new_size, ALLOC);
+      *(int*)h(new_ptr) = delta | ALLOC | PREV_ALLOC;
+      STAT(a->stats.splits++);
 
-      *(int*)h(ptr) = new_size;
-      *(int*)f(ptr,new_size) = -1;
-
-      my_free(new_ptr);
+      heap_free(a, new_ptr);
       return ptr;
     }
-    if (is_free > 0 && goal == last) {
+    if (is_free && goal == a->last) {
       // if we looked to the right and it was free but not big enough,
       // and that block to the right is the last block
       // mem_sbrk that last block by the missing amount
-      last = ptr;
-      del (goal, next_sz);
       int delta = new_size - (old_size + next_sz);
-      mem_sbrk(delta);
-      *(int*)h(ptr) = new_size;
-      *(int*)f(ptr, new_size) = -1;
+      if (arena_sbrk(a, delta) == (void*)-1) return NULL;
+      a->last = ptr;
+      del (a, goal, next_sz);
+      set_block (ptr, new_size, ALLOC);
       return ptr;
     }
   }
+  if (!(*(int*)h(ptr) & PREV_ALLOC)) {
+    // the block before is free: slide the payload down into it, taking the
+    // free block after us too when that is what it takes to fit
+    int prev_sz = *(int*)((char*)ptr - 2*SIZE_T_SIZE);
+    node* next = (node*)((char*)ptr + old_size);
+    int next_sz = 0;
+    if ((char*)next < a->brk && !(*(int*)h(next) & ALLOC)) next_sz = size_of(next);
+    if ((size_t)prev_sz + old_size < (size_t)new_size) {
+      if ((size_t)prev_sz + old_size + next_sz < (size_t)new_size) return NULL;
+    } else {
+      next_sz = 0;
+    }
+    int total = prev_sz + old_size + next_sz;
+    char* start = (char*)ptr - prev_sz;
+    if (ptr == a->last || (next_sz && next == a->last)) a->last = start;
+    del (a, (node*)start, prev_sz);
+    if (next_sz) del (a, next, next_sz);
+    memmove (start, ptr, old_size - SIZE_T_SIZE);
+    int delta = total - new_size;
+    if (delta < MIN_BLOCK) {
+      set_block (start, total, ALLOC);
+      set_next_prev (a, start, total, 1);
+      return start;
+    }
+    void* new_ptr = start + new_size;
 
-  void* newptr;
-  int copy_size;
+    set_block (start, new_size, ALLOC);
+    *(int*)h(new_ptr) = delta | ALLOC | PREV_ALLOC;
+    STAT(a->stats.splits++);
 
-  // Allocate a new chunk of memory, and fail if that allocation fails.
-  newptr = my_malloc(size);
-  if (NULL == newptr) {
-    return NULL;
+    heap_free (a, new_ptr);
+    return start;
   }
 
-  // Get the size of the old block of memory.  Take a peek at my_malloc(),
-  // where we stashed this in the SIZE_T_SIZE bytes directly before the
-  // address we returned.  Now we can back up by that many bytes and read
-  // the size.
-  copy_size = *(int*)h(ptr);
-
-  // If the new block is smaller than the old one, we have to stop copying
-  // early so that we don't write off the end of the new block of memory.
-  if (size < copy_size) {
-    copy_size = size;
-  }
-
-  // This is a standard library call that performs a simple memory copy.
-  memcpy(newptr, ptr, copy_size);
-
-  // Release the old block.
-  my_free(ptr);
-
-  // Return a pointer to the new block.
-  return newptr;
+  return NULL;
 }
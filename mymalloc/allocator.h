@@ -43,4 +43,97 @@
 // The smallest aligned size that will hold a size_t value.
 // #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 #define SIZE_T_SIZE 4
+
+// Number of independent arenas. Threads are assigned round-robin, or by the
+// cpu they first allocate on when ARENA_BY_CPU is defined.
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 8
+#endif
+
+// Address space reserved for each arena other than the brk heap.
+#ifndef ARENA_RESERVE
+#define ARENA_RESERVE (1UL << 34)
+#endif
+
+// Requests of at least this many bytes get a mapping of their own.
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+// A free block at the top of the heap bigger than this many bytes is trimmed,
+// returning all but half of the threshold to the os.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (256 * 1024)
+#endif
+
+// Milliseconds a large free block stays untouched before its pages are purged.
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 10000
+#endif
+
+// calloc clears blocks of at least this many bytes with non-temporal stores.
+#ifndef CALLOC_STREAM_MIN
+#define CALLOC_STREAM_MIN (256 * 1024)
+#endif
+
+// Largest request served from header-free slab runs, 0 disables them.
+#ifndef SLAB_MAX
+#define SLAB_MAX 32
+#endif
+
+// Runs worth of requests a size class serves from the heap before it gets
+// slab runs of its own.
+#ifndef SLAB_HOT
+#define SLAB_HOT 1
+#endif
+
+// Largest aligned block size served out of the per-thread caches.
+#ifndef TCACHE_MAX
+#define TCACHE_MAX 512
+#endif
+
+// Maximum number of blocks a thread keeps cached per size class.
+#ifndef TCACHE_FILL
+#define TCACHE_FILL 32
+#endif
+
+// Maximum number of blocks moved between a thread cache and the shared
+// free lists on a single refill or spill.
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH 16
+#endif
+
+// Largest block an arena parks on its quick lists when it is freed, leaving
+// it uncoalesced until a request cannot be met otherwise. Deferred coalescing
+// is opt-in: the default 0 compiles it out and coalesces every free right
+// away. Build with make QUICK_MAX=n to enable it.
+#ifndef QUICK_MAX
+#define QUICK_MAX 0
+#endif
+
+// Blocks a quick list may hold before they are all coalesced.
+#ifndef QUICK_FILL
+#define QUICK_FILL 64
+#endif
+
+// Keep the counters behind my_malloc_stats, 0 leaves the function out.
+#ifndef MALLOC_STATS
+#define MALLOC_STATS 1
+#endif
+
+// Bytes a region takes from the heap at a time.
+#ifndef REGION_CHUNK
+#define REGION_CHUNK (64 * 1024)
+#endif
+
+// Check the size passed to my_free_sized against the block and abort when it
+// does not fit. On in debug builds only, release builds trust the caller.
+#ifndef FREE_SIZED_CHECK
+#ifdef NDEBUG
+#define FREE_SIZED_CHECK 0
+#else
+#define FREE_SIZED_CHECK 1
+#endif
+#endif
+
 #endif  // MM_ALLOCATOR_H
@@ -59,10 +59,41 @@ static const malloc_impl_t libc_impl = {.init = &libc_init,
                                         .heap_lo = &libc_heap_lo,
                                         .heap_hi = &libc_heap_hi};
 
+// Number of size bins in my_malloc_stats_t, bin i counting the free blocks
+// of 2^i up to 2^(i+1) bytes.
+#define MY_STATS_BINS 32
+
+// Heap statistics as reported by my_malloc_stats. Only built when the
+// allocator is compiled with MALLOC_STATS.
+typedef struct {
+  size_t heap_bytes;       // bytes taken from the os for the arena heaps
+  size_t allocated_bytes;  // heap bytes not in a free block, caches included
+  size_t free_bytes;       // heap bytes in free blocks
+  size_t largest_free;     // size of the largest free block
+  size_t mmapped_bytes;    // bytes in blocks with a mapping of their own
+  size_t bin_blocks[MY_STATS_BINS];
+  size_t bin_bytes[MY_STATS_BINS];
+  size_t sbrk_calls;       // times an arena heap was extended
+  size_t mmap_calls;
+  size_t munmap_calls;
+  size_t mremap_calls;
+  size_t splits;           // free blocks split to serve a request
+  size_t coalesces;        // free blocks merged with a neighbour
+  size_t realloc_in_place; // reallocs that kept their block
+  size_t realloc_copy;     // reallocs that copied into a new block
+} my_malloc_stats_t;
+
 int my_init();
 void* my_malloc(size_t size);
 void* my_realloc(void* ptr, size_t size);
 void my_free(void* ptr);
+void* my_calloc(size_t count, size_t size);
+void* my_memalign(size_t alignment, size_t size);
+size_t my_malloc_usable_size(void* ptr);
+void my_free_sized(void* ptr, size_t size);
+size_t my_malloc_batch(size_t size, size_t n, void** out);
+void my_free_batch(void** ptrs, size_t n);
+void my_malloc_stats(my_malloc_stats_t* st);
 int my_check();
 void my_reset_brk();
 void* my_heap_lo();
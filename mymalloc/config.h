@@ -37,6 +37,28 @@
 
 #define MEM_ALLOWANCE (40 * (1 << 10)) /* 40 KB */
 
+/*
+ * Requests read ahead at a time when a trace is streamed (mdriver -s)
+ */
+#define TRACE_CHUNK (1 << 16)
+
+/*
+ * Huge page backing for the heap: 0 uses ordinary pages, 1 grows the heap in
+ * 2 MB aligned chunks advised for transparent huge pages, 2 maps the chunks
+ * from the hugetlbfs pool and falls back to transparent huge pages when the
+ * pool runs dry. Set with make HUGE_PAGES=n.
+ */
+#ifndef MEM_HUGE_PAGES
+#define MEM_HUGE_PAGES 0
+#endif
+
+#define MEM_HUGE_PAGE (2 * (1 << 20)) /* 2 MB */
+
+/*
+ * Address space reserved for the huge page heap, the same as an arena
+ */
+#define MEM_HUGE_RESERVE (1UL << 34) /* 16 GB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
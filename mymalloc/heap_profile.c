@@ -0,0 +1,350 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+#define _GNU_SOURCE
+#include "./heap_profile.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./memlib.h"
+
+// frames of the call stack recorded per sample, and frames skipped at its
+// top: prof_sample and the wrapper entry point prof_malloc is inlined into
+#define PROF_DEPTH 32
+#define PROF_SKIP 2
+
+#define SAMPLE_BUCKETS (1 << PROF_FILTER_BITS)
+#define STACK_BUCKETS (1 << 16)
+
+// the profiler never calls malloc; its tables and records come from mem_map
+#define PROF_CHUNK (1 << 20)
+
+// a distinct call stack, with the samples taken at it that are still live
+// and every sample taken at it so far
+typedef struct prof_stack {
+  struct prof_stack* next;
+  uint64_t hash;
+  int depth;
+  size_t live_count;
+  size_t live_bytes;
+  size_t alloc_count;
+  size_t alloc_bytes;
+  void* pc[PROF_DEPTH];
+} prof_stack;
+
+// a live sampled block, chained in the bucket of its filter slot
+typedef struct prof_entry {
+  struct prof_entry* next;
+  void* ptr;
+  size_t size;
+  prof_stack* stack;
+} prof_entry;
+
+size_t prof_rate = 0;
+__thread intptr_t prof_countdown __attribute__((tls_model("initial-exec")));
+uint16_t* prof_filter = NULL;
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static prof_entry** samples;
+static prof_stack** stacks;
+static prof_entry* free_entries;
+static char* pool;
+static char* pool_end;
+
+static const char* prof_prefix = "mymalloc";
+static int prof_seq = 0;
+static volatile sig_atomic_t dump_pending = 0;
+
+// set while this thread is inside the profiler, so that allocations made by
+// backtrace are not sampled in turn
+static __thread int in_prof __attribute__((tls_model("initial-exec")));
+static __thread uint64_t prof_seed __attribute__((tls_model("initial-exec")));
+
+// carve n bytes out of the profiler's own chunks. Caller holds prof_lock.
+static void* prof_alloc(size_t n) {
+  n = (n + 15) & ~(size_t)15;
+  if ((size_t)(pool_end - pool) < n) {
+    char* chunk = (char*)mem_map(PROF_CHUNK);
+    if (chunk == (void*)-1) return NULL;
+    pool = chunk;
+    pool_end = chunk + PROF_CHUNK;
+  }
+  void* p = pool;
+  pool += n;
+  return p;
+}
+
+// bytes until the next sample, drawn from an exponential distribution with
+// mean prof_rate so that samples fall at random points of the byte stream
+static intptr_t prof_next(void) {
+  uint64_t x = prof_seed;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  prof_seed = x;
+  double u = (double)((x * 0x2545f4914f6cdd1dULL) >> 11) + 1.0;
+  u *= 1.0 / 9007199254740992.0;  // (0, 1]
+  return (intptr_t)(-log(u) * (double)prof_rate) + 1;
+}
+
+static uint64_t stack_hash(void** pc, int depth) {
+  uint64_t h = 0;
+  for (int i = 0; i < depth; i++) {
+    h = (h + (uintptr_t)pc[i]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+// the record of call stack pc, made on first sight. Caller holds prof_lock.
+static prof_stack* stack_find(void** pc, int depth) {
+  uint64_t h = stack_hash(pc, depth);
+  prof_stack** bucket = &stacks[h & (STACK_BUCKETS - 1)];
+  for (prof_stack* s = *bucket; s != NULL; s = s->next) {
+    if (s->hash == h && s->depth == depth &&
+        memcmp(s->pc, pc, depth * sizeof(void*)) == 0) {
+      return s;
+    }
+  }
+  prof_stack* s = (prof_stack*)prof_alloc(sizeof(prof_stack));
+  if (s == NULL) return NULL;
+  memset(s, 0, sizeof(*s));
+  s->hash = h;
+  s->depth = depth;
+  memcpy(s->pc, pc, depth * sizeof(void*));
+  s->next = *bucket;
+  *bucket = s;
+  return s;
+}
+
+// buffered writes of the profile, which is only written with prof_lock held
+static char out[4096];
+static size_t out_len;
+
+static void out_flush(int fd) {
+  size_t done = 0;
+  while (done < out_len) {
+    ssize_t n = write(fd, out + done, out_len - done);
+    if (n <= 0) break;
+    done += n;
+  }
+  out_len = 0;
+}
+
+static void out_printf(int fd, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void out_printf(int fd, const char* fmt, ...) {
+  if (sizeof(out) - out_len < 512) out_flush(fd);
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(out + out_len, sizeof(out) - out_len, fmt, ap);
+  va_end(ap);
+  if (n > 0) out_len += ((size_t)n < sizeof(out) - out_len) ? (size_t)n : 0;
+}
+
+/*
+ * prof_dump - write the live and cumulative profiles to the next
+ *    <prefix>.<pid>.<seq>.heap in the legacy pprof heap format: a header
+ *    with the totals and the sampling rate, one line per call stack, and the
+ *    process's mappings so pprof can symbolize the addresses.
+ */
+static void prof_dump(void) {
+  char name[4096];
+  pthread_mutex_lock(&prof_lock);
+  snprintf(name, sizeof(name), "%s.%d.%04d.heap", prof_prefix, (int)getpid(),
+           prof_seq++);
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    pthread_mutex_unlock(&prof_lock);
+    return;
+  }
+
+  size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+  for (int b = 0; b < STACK_BUCKETS; b++) {
+    for (prof_stack* s = stacks[b]; s != NULL; s = s->next) {
+      live_count += s->live_count;
+      live_bytes += s->live_bytes;
+      alloc_count += s->alloc_count;
+      alloc_bytes += s->alloc_bytes;
+    }
+  }
+  out_len = 0;
+  out_printf(fd, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+             live_count, live_bytes, alloc_count, alloc_bytes, prof_rate);
+  for (int b = 0; b < STACK_BUCKETS; b++) {
+    for (prof_stack* s = stacks[b]; s != NULL; s = s->next) {
+      out_printf(fd, "%6zu: %8zu [%6zu: %8zu] @", s->live_count, s->live_bytes,
+                 s->alloc_count, s->alloc_bytes);
+      for (int i = 0; i < s->depth; i++) out_printf(fd, " %p", s->pc[i]);
+      out_printf(fd, "\n");
+    }
+  }
+
+  out_printf(fd, "\nMAPPED_LIBRARIES:\n");
+  out_flush(fd);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps >= 0) {
+    ssize_t n;
+    while ((n = read(maps, out, sizeof(out))) > 0) {
+      out_len = n;
+      out_flush(fd);
+    }
+    close(maps);
+  }
+  close(fd);
+  pthread_mutex_unlock(&prof_lock);
+}
+
+// a dump needs the profiler's lock, so the signal only asks for one and the
+// next sample writes it
+static void prof_signal(int sig) { dump_pending = 1; }
+
+static void prof_exit(void) {
+  in_prof = 1;
+  prof_dump();
+}
+
+/*
+ * prof_init - turn on sampling if MYMALLOC_PROF holds a sampling rate
+ */
+void prof_init(void) {
+  const char* rate = getenv("MYMALLOC_PROF");
+  if (rate == NULL) return;
+  size_t r = strtoul(rate, NULL, 10);
+  if (r == 0) return;
+  const char* prefix = getenv("MYMALLOC_PROF_FILE");
+  if (prefix != NULL && *prefix != '\0') prof_prefix = prefix;
+
+  uint16_t* filter = (uint16_t*)mem_map(SAMPLE_BUCKETS * sizeof(uint16_t));
+  samples = (prof_entry**)mem_map(SAMPLE_BUCKETS * sizeof(prof_entry*));
+  stacks = (prof_stack**)mem_map(STACK_BUCKETS * sizeof(prof_stack*));
+  if (filter == (void*)-1 || samples == (void*)-1 || stacks == (void*)-1) {
+    fprintf(stderr, "mymalloc: cannot map the heap profiler's tables\n");
+    return;
+  }
+
+  const char* sig = getenv("MYMALLOC_PROF_SIGNAL");
+  int signum = (sig != NULL) ? atoi(sig) : SIGUSR2;
+  if (signum > 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(signum, &sa, NULL);
+  }
+  atexit(prof_exit);
+
+  // the first backtrace loads the unwinder, which allocates
+  void* warm[1];
+  in_prof = 1;
+  backtrace(warm, 1);
+  in_prof = 0;
+
+  prof_filter = filter;
+  __atomic_store_n(&prof_rate, r, __ATOMIC_RELEASE);
+}
+
+/*
+ * prof_sample - called by prof_malloc once the thread's countdown runs out.
+ *    Records the block at p with the current call stack, and draws the
+ *    distance to the next sample.
+ */
+void prof_sample(void* p, size_t size) {
+  if (in_prof) return;
+  in_prof = 1;
+  if (prof_seed == 0) {
+    // a thread's first countdown is drawn on its first allocation
+    prof_seed = ((uintptr_t)&prof_seed * 0x9e3779b97f4a7c15ULL) | 1;
+    prof_countdown += prof_next();
+    if (prof_countdown >= 0) {
+      in_prof = 0;
+      return;
+    }
+  }
+  while (prof_countdown < 0) prof_countdown += prof_next();
+
+  void* pc[PROF_DEPTH + PROF_SKIP];
+  int depth = backtrace(pc, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+  if (depth < 0) depth = 0;
+
+  pthread_mutex_lock(&prof_lock);
+  prof_stack* s = stack_find(pc + PROF_SKIP, depth);
+  prof_entry* e = free_entries;
+  if (e != NULL) {
+    free_entries = e->next;
+  } else {
+    e = (prof_entry*)prof_alloc(sizeof(prof_entry));
+  }
+  if (s != NULL && e != NULL) {
+    uint32_t slot = prof_slot(p);
+    e->ptr = p;
+    e->size = size;
+    e->stack = s;
+    e->next = samples[slot];
+    samples[slot] = e;
+    __atomic_fetch_add(&prof_filter[slot], 1, __ATOMIC_RELAXED);
+    s->live_count++;
+    s->live_bytes += size;
+    s->alloc_count++;
+    s->alloc_bytes += size;
+  } else if (e != NULL) {
+    e->next = free_entries;
+    free_entries = e;
+  }
+  pthread_mutex_unlock(&prof_lock);
+
+  if (dump_pending) {
+    dump_pending = 0;
+    prof_dump();
+  }
+  in_prof = 0;
+}
+
+/*
+ * prof_forget - drop the sample at p, if there is one, before p goes away
+ */
+void prof_forget(void* p) {
+  uint32_t slot = prof_slot(p);
+  pthread_mutex_lock(&prof_lock);
+  for (prof_entry** e = &samples[slot]; *e != NULL; e = &(*e)->next) {
+    if ((*e)->ptr != p) continue;
+    prof_entry* dead = *e;
+    *e = dead->next;
+    __atomic_fetch_sub(&prof_filter[slot], 1, __ATOMIC_RELAXED);
+    dead->stack->live_count--;
+    dead->stack->live_bytes -= dead->size;
+    dead->next = free_entries;
+    free_entries = dead;
+    break;
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
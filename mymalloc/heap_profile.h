@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/**
+ * heap_profile.h
+ *
+ * Sampling heap profiler for malloc_wrapper.so. Setting MYMALLOC_PROF to a
+ * number of bytes samples about one allocation per that many bytes
+ * allocated, and remembers the call stack of each sample until it is freed.
+ * Profiles are written in the legacy pprof heap format at exit, and when the
+ * process gets MYMALLOC_PROF_SIGNAL (SIGUSR2 by default) at the next sample.
+ * MYMALLOC_PROF_FILE sets the file name prefix, "mymalloc" by default.
+ **/
+
+#ifndef MM_HEAP_PROFILE_H
+#define MM_HEAP_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// mean number of bytes between two samples, 0 when profiling is off
+extern size_t prof_rate;
+
+// bytes this thread may still allocate before the next sample
+extern __thread intptr_t prof_countdown;
+
+// one counter per hash slot of the sampled pointers that are still live, so
+// free only takes the profiler's lock for pointers that may be sampled
+#define PROF_FILTER_BITS 20
+extern uint16_t* prof_filter;
+
+#define prof_slot(p) \
+  ((uint32_t)(((uintptr_t)(p) * 0x9e3779b97f4a7c15ULL) >> (64 - PROF_FILTER_BITS)))
+
+void prof_init(void);
+void prof_sample(void* p, size_t size);
+void prof_forget(void* p);
+
+// count size bytes allocated at p towards the next sample
+__attribute__((always_inline)) static inline void prof_malloc(void* p,
+                                                        size_t size) {
+  if (prof_rate == 0 || p == NULL) return;
+  prof_countdown -= (intptr_t)size;
+  if (prof_countdown < 0) prof_sample(p, size);
+}
+
+// drop the sample at p, if p was sampled, before p is freed or resized
+static inline void prof_free(void* p) {
+  if (prof_filter == NULL || p == NULL) return;
+  if (__atomic_load_n(&prof_filter[prof_slot(p)], __ATOMIC_RELAXED)) {
+    prof_forget(p);
+  }
+}
+
+#endif  // MM_HEAP_PROFILE_H
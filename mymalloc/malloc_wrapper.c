@@ -1,25 +1,39 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "allocator.h"
 #include "allocator_interface.h"
+#include "heap_profile.h"
 #include "memlib.h"
+#include "trace_record.h"
 
 static int initialized = 0;
 
-__attribute__((always_inline)) static void init() {
+static inline void init(void) {
   if (initialized) return;
   initialized = 1;
   mem_init();
   my_init();
 }
 
+// the profiler (MYMALLOC_PROF) and the recorder are set up from the
+// environment, which the first allocations, made by the loader before environ
+// is in place, come too early to see. so they start here rather than on the
+// first malloc.
+__attribute__((constructor)) static void init_tools(void) {
+  init();
+  prof_init();
+  rec_init();
+}
+
 void* calloc(size_t count, size_t size) {
   init();
-  void* ptr = malloc(count * size);
-  assert(ptr && "calloc nomemory");
-  bzero(ptr, count * size);
+  void* ptr = my_calloc(count, size);
+  prof_malloc(ptr, count * size);
+  rec_malloc(ptr, count * size);
   return ptr;
 }
 
@@ -27,14 +41,142 @@ void* malloc(size_t size) {
   init();
   void* ptr = my_malloc(size);
   assert(ptr);
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
   return ptr;
 }
 
-void free(void* ptr) { my_free(ptr); }
+void free(void* ptr) {
+  prof_free(ptr);
+  rec_free(ptr);
+  my_free(ptr);
+}
+
+void free_sized(void* ptr, size_t size) {
+  prof_free(ptr);
+  rec_free(ptr);
+  my_free_sized(ptr, size);
+}
+
+// aligned blocks are freed like any other once the size is known
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+  prof_free(ptr);
+  rec_free(ptr);
+  my_free_sized(ptr, size);
+}
+
+size_t malloc_usable_size(void* ptr) { return my_malloc_usable_size(ptr); }
 
 void* realloc(void* ptr, size_t size) {
   init();
+  // the old sample goes first, the block may be someone else's once we return
+  prof_free(ptr);
+  rec_realloc_begin(ptr);
+  void* old = ptr;
   ptr = my_realloc(ptr, size);
   assert(ptr && "malloc no memory");
+  prof_malloc(ptr, size);
+  rec_realloc(old, ptr, size);
+  return ptr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  init();
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* ptr = my_memalign(alignment, size);
+  if (ptr == NULL) return ENOMEM;
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
+  *memptr = ptr;
+  return 0;
+}
+
+// like posix_memalign, the rest of the aligned family tells a bad alignment
+// (EINVAL) from a failed allocation (ENOMEM), only through errno
+static inline int bad_alignment(size_t alignment) {
+  if (alignment != 0 && (alignment & (alignment - 1)) == 0) return 0;
+  errno = EINVAL;
+  return 1;
+}
+
+void* memalign(size_t alignment, size_t size) {
+  init();
+  if (bad_alignment(alignment)) return NULL;
+  void* ptr = my_memalign(alignment, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
+  return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  init();
+  if (bad_alignment(alignment)) return NULL;
+  void* ptr = my_memalign(alignment, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
+  return ptr;
+}
+
+void* valloc(size_t size) {
+  init();
+  void* ptr = my_memalign(mem_pagesize(), size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
+  return ptr;
+}
+
+void* pvalloc(size_t size) {
+  init();
+  size_t page = mem_pagesize();
+  // rounding up to a page must not wrap around to a small size
+  if (size > SIZE_MAX - (page - 1)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = (size + page - 1) & ~(page - 1);
+  void* ptr = my_memalign(page, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  prof_malloc(ptr, size);
+  rec_malloc(ptr, size);
   return ptr;
 }
+
+#if MALLOC_STATS
+// the heap totals on stderr, like glibc's malloc_stats
+void malloc_stats(void) {
+  my_malloc_stats_t st;
+  my_malloc_stats(&st);
+  fprintf(stderr, "heap bytes      = %10zu\n", st.heap_bytes);
+  fprintf(stderr, "in use bytes    = %10zu\n", st.allocated_bytes);
+  fprintf(stderr, "free bytes      = %10zu\n", st.free_bytes);
+  fprintf(stderr, "largest free    = %10zu\n", st.largest_free);
+  fprintf(stderr, "mmapped bytes   = %10zu\n", st.mmapped_bytes);
+  for (int i = 0; i < MY_STATS_BINS; i++) {
+    if (st.bin_blocks[i] == 0) continue;
+    fprintf(stderr, "  free [2^%d, 2^%d) = %zu blocks, %zu bytes\n", i, i + 1,
+            st.bin_blocks[i], st.bin_bytes[i]);
+  }
+  fprintf(stderr, "sbrk %zu, mmap %zu, munmap %zu, mremap %zu\n", st.sbrk_calls,
+          st.mmap_calls, st.munmap_calls, st.mremap_calls);
+  fprintf(stderr, "splits %zu, coalesces %zu\n", st.splits, st.coalesces);
+  fprintf(stderr, "realloc in place %zu, copied %zu\n", st.realloc_in_place,
+          st.realloc_copy);
+}
+#endif
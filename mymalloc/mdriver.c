@@ -11,8 +11,13 @@
  */
 
 #include "./mdriver.h"
+#include "./region.h"
 
+#include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "./validator.h"
 
@@ -67,6 +72,11 @@ static void eval_libc_speed(trace_t* trace) {
 }
 static int eval_mm_check(const malloc_impl_t* impl, trace_t* trace,
                          int tracenum);
+static int eval_mm_bulk_check(const malloc_impl_t* impl);
+static void eval_mm_scaling(const malloc_impl_t* impl, int n,
+                            char** tracefiles, int max_threads);
+static void eval_mm_stream(const malloc_impl_t* impl, int n,
+                           char** tracefiles);
 
 /* Various helper routines */
 static void printresults(int n, char** tracefiles, stats_t* stats);
@@ -91,6 +101,8 @@ int main(int argc, char** argv) {
   int run_bad = 0;    /* If set, run bad malloc (set by -b) */
   int check_heap = 0; /* If set, run the student heap checker (set by -c) */
   int autograder = 0; /* If set, emit summary info for autograder (-g) */
+  int max_threads = 0; /* If set, sweep threaded replay up to it (-j) */
+  int stream = 0;      /* If set, stream the traces instead (-s) */
 
   /* temporaries used to compute the performance index */
   double total_log_throughput, total_log_util, average_log_util,
@@ -99,7 +111,7 @@ int main(int argc, char** argv) {
   /*
    * Read and interpret the command line arguments
    */
-  while ((c = getopt(argc, argv, "f:t:hvVgcb")) != EOF) {
+  while ((c = getopt(argc, argv, "f:t:j:shvVgcb")) != EOF) {
     switch (c) {
       case 'g': /* Generate summary info for the autograder */
         autograder = 1;
@@ -131,6 +143,16 @@ int main(int argc, char** argv) {
       case 'c':
         check_heap = 1;
         break;
+      case 'j': /* Replay on up to this many threads */
+        max_threads = atoi(optarg);
+        if (max_threads < 1) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 's': /* Replay the traces without loading them */
+        stream = 1;
+        break;
       case 'v': /* Print per-trace performance breakdown */
         verbose = 1;
         break;
@@ -181,6 +203,26 @@ int main(int argc, char** argv) {
     }
   }
 
+  /* The scaling sweep replaces the usual evaluation */
+  if (max_threads > 0) {
+    eval_mm_scaling(&my_impl, num_tracefiles, tracefiles, max_threads);
+    for (i = 0; i < num_tracefiles; i++) {
+      free(tracefiles[i]);
+    }
+    free(tracefiles);
+    exit(errors != 0);
+  }
+
+  /* So does streaming */
+  if (stream) {
+    eval_mm_stream(&my_impl, num_tracefiles, tracefiles);
+    for (i = 0; i < num_tracefiles; i++) {
+      free(tracefiles[i]);
+    }
+    free(tracefiles);
+    exit(errors != 0);
+  }
+
   /* Initialize the timing package */
   init_fsecs();
 
@@ -314,6 +356,15 @@ int main(int argc, char** argv) {
     }
     free_trace(trace);
   }
+  if (check_heap) {
+    if (verbose > 1) {
+      printf("Checking regions and batches.\n");
+    }
+    /* the large objects are only mapped if mappings are allowed */
+    mem_allow_map(1);
+    eval_mm_bulk_check(&my_impl);
+    mem_allow_map(0);
+  }
 
   /* Free the simulated heap block. */
   mem_deinit();
@@ -407,108 +458,28 @@ int main(int argc, char** argv) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a text or binary trace file and store it in memory
  */
 static trace_t* read_trace(char* tracedir, char* filename) {
-  FILE* tracefile;
   trace_t* trace;
-  char type[MAXLINE];
   char path[MAXLINE];
-  unsigned index, size;
-  unsigned max_index = 0;
-  unsigned op_index;
 
   if (verbose > 1) {
     printf("Reading tracefile: %s\n", filename);
   }
 
-  /* Allocate the trace record */
-  if ((trace = (trace_t*)malloc(sizeof(trace_t))) == NULL) {
-    unix_error("malloc 1 failed in read_trance");
-  }
-
-  /* Read the trace file header */
   snprintf(path, MAXLINE, "%s%s", tracedir, filename);
-  if ((tracefile = fopen(path, "r")) == NULL) {
-    snprintf(msg, MAXLINE, "Could not open %s in read_trace", path);
+  if ((trace = trace_load(path)) == NULL) {
+    snprintf(msg, MAXLINE, "Could not read %s in read_trace", path);
     unix_error(msg);
   }
-  fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-  fscanf(tracefile, "%d", &(trace->num_ids));
-  fscanf(tracefile, "%d", &(trace->num_ops));
-  fscanf(tracefile, "%d", &(trace->weight)); /* not used */
-
-  /* We'll store each request line in the trace in this array */
-  if ((trace->ops = (traceop_t*)malloc(trace->num_ops * sizeof(traceop_t))) ==
-      NULL) {
-    unix_error("malloc 2 failed in read_trace");
-  }
-
-  /* We'll keep an array of pointers to the allocated blocks here... */
-  if ((trace->blocks = (char**)malloc(trace->num_ids * sizeof(char*))) ==
-      NULL) {
-    unix_error("malloc 3 failed in read_trace");
-  }
-
-  /* ... along with the corresponding byte sizes of each block */
-  if ((trace->block_sizes = (size_t*)malloc(trace->num_ids * sizeof(size_t))) ==
-      NULL) {
-    unix_error("malloc 4 failed in read_trace");
-  }
-
-  /* read every request line in the trace file */
-  index = 0;
-  op_index = 0;
-  while (fscanf(tracefile, "%s", type) != EOF) {
-    switch (type[0]) {
-      case 'a':
-        fscanf(tracefile, "%u %u", &index, &size);
-        trace->ops[op_index].type = ALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-      case 'r':
-        fscanf(tracefile, "%u %u", &index, &size);
-        trace->ops[op_index].type = REALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-      case 'f':
-        fscanf(tracefile, "%ud", &index);
-        trace->ops[op_index].type = FREE;
-        trace->ops[op_index].index = index;
-        break;
-      case 'w':
-        fscanf(tracefile, "%u %u", &index, &size);
-        trace->ops[op_index].type = WRITE;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        break;
-      default:
-        printf("Bogus type character (%c) in tracefile %s\n", type[0], path);
-        exit(1);
-    }
-    op_index++;
-  }
-  fclose(tracefile);
-  assert((int)max_index == trace->num_ids - 1);
-  assert(trace->num_ops == (int)op_index);
-
   return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record and everything it points to
  */
-void free_trace(trace_t* trace) {
-  free(trace->ops); /* free the three arrays... */
-  free(trace->blocks);
-  free(trace->block_sizes);
-  free(trace); /* and the trace record itself... */
-}
+void free_trace(trace_t* trace) { trace_free(trace); }
 
 /**********************************************************************
  * The following functions evaluate the space utilization and
@@ -677,6 +648,410 @@ static void eval_mm_speed(const malloc_impl_t* impl, trace_t* trace) {
   }
 }
 
+/* One replay thread of eval_mm_threads */
+typedef struct {
+  const malloc_impl_t* impl;
+  trace_t* trace;
+  int thread;      /* number of this replay thread */
+  int num_threads; /* replay threads in this run */
+  int* op_seq;     /* shared replay: position of each op among those on its block */
+  int* block_done; /* shared replay: ops finished so far on each block */
+  char** blocks;   /* blocks of this thread's copy, or the shared ones */
+  pthread_barrier_t* start;
+  long ops;    /* requests replayed by this thread */
+  double secs; /* time from the start barrier to the last request */
+  int failed;
+} replay_t;
+
+static double now_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * replay_thread - Replay a trace like eval_mm_speed, on a thread of its own.
+ *    A private copy replays every request. A shared replay only takes the
+ *    requests tagged with its thread, and waits for the requests before
+ *    them on the same block, which may be issued by any thread, so blocks
+ *    get freed by other threads than the ones that allocated them.
+ */
+static void* replay_thread(void* arg) {
+  replay_t* r = (replay_t*)arg;
+  trace_t* trace = r->trace;
+  int shared = (r->op_seq != NULL);
+  char** blocks = r->blocks;
+
+  pthread_barrier_wait(r->start);
+  double start = now_secs();
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_t* op = &trace->ops[i];
+    int index = op->index;
+    if (shared) {
+      if (op->thread % r->num_threads != r->thread) continue;
+      while (__atomic_load_n(&r->block_done[index], __ATOMIC_ACQUIRE) !=
+             r->op_seq[i]) {
+        sched_yield();
+      }
+    }
+    char* p;
+    switch (op->type) {
+      case ALLOC:
+        if ((p = (char*)r->impl->malloc(op->size)) == NULL) {
+          r->failed = 1;
+          return NULL;
+        }
+        blocks[index] = p;
+        break;
+      case REALLOC:
+        if ((p = (char*)r->impl->realloc(blocks[index], op->size)) == NULL) {
+          r->failed = 1;
+          return NULL;
+        }
+        blocks[index] = p;
+        break;
+      case FREE:
+        r->impl->free(blocks[index]);
+        break;
+      case WRITE:
+        p = blocks[index];
+        for (int offset = 1; offset < op->size; offset++) {
+          mem_op(p + offset - 1, p + offset);
+        }
+        break;
+      default:
+        app_error("Nonexistent request type in replay_thread");
+    }
+    if (shared) {
+      __atomic_store_n(&r->block_done[index], r->op_seq[i] + 1,
+                       __ATOMIC_RELEASE);
+    }
+    r->ops++;
+  }
+  r->secs = now_secs() - start;
+  return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay a trace on num_threads threads at once against
+ *    one allocator instance, and print the aggregate and per-thread
+ *    throughput. Traces tagged with several threads are split between the
+ *    replay threads, any other trace is replayed once by every thread.
+ *    Returns the aggregate throughput in ops/sec, or 0 if a request failed.
+ */
+static double eval_mm_threads(const malloc_impl_t* impl, trace_t* trace,
+                              int num_threads, double base) {
+  int shared = (trace->num_threads > 1);
+  replay_t* r = (replay_t*)calloc(num_threads, sizeof(replay_t));
+  pthread_t* tids = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+  int* op_seq = NULL;
+  int* block_done = NULL;
+  if (r == NULL || tids == NULL) {
+    unix_error("calloc failed in eval_mm_threads");
+  }
+  if (shared) {
+    op_seq = (int*)malloc(trace->num_ops * sizeof(int));
+    block_done = (int*)calloc(trace->num_ids, sizeof(int));
+    if (op_seq == NULL || block_done == NULL) {
+      unix_error("malloc failed in eval_mm_threads");
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+      op_seq[i] = block_done[trace->ops[i].index]++;
+    }
+    memset(block_done, 0, trace->num_ids * sizeof(int));
+  }
+
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, num_threads);
+  mem_reset_brk();
+  if (impl->init() < 0) {
+    app_error("init failed in eval_mm_threads");
+  }
+  for (int t = 0; t < num_threads; t++) {
+    r[t].impl = impl;
+    r[t].trace = trace;
+    r[t].thread = t;
+    r[t].num_threads = num_threads;
+    r[t].op_seq = op_seq;
+    r[t].block_done = block_done;
+    r[t].start = &start;
+    if (shared && t > 0) {
+      r[t].blocks = r[0].blocks;
+    } else if ((r[t].blocks = (char**)malloc(trace->num_ids * sizeof(char*))) ==
+               NULL) {
+      unix_error("malloc failed in eval_mm_threads");
+    }
+    if (pthread_create(&tids[t], NULL, replay_thread, &r[t]) != 0) {
+      unix_error("pthread_create failed in eval_mm_threads");
+    }
+  }
+
+  long ops = 0;
+  double secs = 0, min_tput = 0, max_tput = 0, sum_tput = 0;
+  int failed = 0;
+  for (int t = 0; t < num_threads; t++) {
+    pthread_join(tids[t], NULL);
+    failed |= r[t].failed;
+    ops += r[t].ops;
+    secs = (r[t].secs > secs) ? r[t].secs : secs;
+    double tput = (r[t].secs > 0) ? r[t].ops / r[t].secs : 0;
+    min_tput = (t == 0 || tput < min_tput) ? tput : min_tput;
+    max_tput = (tput > max_tput) ? tput : max_tput;
+    sum_tput += tput;
+  }
+  pthread_barrier_destroy(&start);
+
+  double tput = 0;
+  if (failed) {
+    errors++;
+    printf("%8d%12s\n", num_threads, "failed");
+  } else {
+    tput = (secs > 0) ? ops / secs : 0;
+    printf("%8d%12.0f%9.2f%12.0f%10.0f%10.0f\n", num_threads, tput / 1e3,
+           (base > 0) ? tput / base : 1.0, min_tput / 1e3,
+           sum_tput / num_threads / 1e3, max_tput / 1e3);
+  }
+
+  for (int t = 0; t < num_threads; t++) {
+    if (!shared || t == 0) free(r[t].blocks);
+  }
+  free(op_seq);
+  free(block_done);
+  free(tids);
+  free(r);
+  return tput;
+}
+
+/*
+ * eval_mm_scaling - For every trace, replay it on 1, 2, 4, ... threads up
+ *    to max_threads and print the scaling curve. The allocator gets real
+ *    mappings here, so that its threads can spread over its arenas.
+ */
+static void eval_mm_scaling(const malloc_impl_t* impl, int n,
+                            char** tracefiles, int max_threads) {
+  mem_init();
+  mem_allow_map(1);
+  for (int i = 0; i < n; i++) {
+    trace_t* trace = read_trace(tracedir, tracefiles[i]);
+    printf("\n%s: %d ops, %s\n", tracefiles[i], trace->num_ops,
+           (trace->num_threads > 1) ? "threads split the tagged requests"
+                                    : "one copy per thread");
+    printf("%8s%12s%9s  %s\n", "threads", "Kops/sec", "speedup",
+           "per thread Kops/sec min/avg/max");
+    double base = 0;
+    for (int t = 1;; t *= 2) {
+      if (t > max_threads) t = max_threads;
+      double tput = eval_mm_threads(impl, trace, t, base);
+      if (t == 1) base = tput;
+      if (t == max_threads) break;
+    }
+    free_trace(trace);
+  }
+  mem_allow_map(0);
+  mem_deinit();
+}
+
+/*
+ * The live blocks of a streamed replay, in an open addressing hash table
+ * keyed by trace id. It holds only the blocks allocated and not yet freed,
+ * so its size follows the live set rather than the id space.
+ */
+typedef struct {
+  uint32_t id;
+  uint32_t size; /* payload size, for the utilization */
+  char* p;       /* NULL for an empty slot */
+} live_t;
+
+typedef struct {
+  live_t* slots;
+  int bits;     /* the table has 1 << bits slots */
+  size_t count; /* live blocks */
+} live_table_t;
+
+static size_t live_hash(const live_table_t* t, uint32_t id) {
+  return (size_t)((id * 0x9E3779B97F4A7C15ull) >> (64 - t->bits));
+}
+
+/*
+ * live_find - Return the slot of id, or the empty slot it would go in
+ */
+static live_t* live_find(const live_table_t* t, uint32_t id) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  for (size_t i = live_hash(t, id);; i = (i + 1) & mask) {
+    live_t* e = &t->slots[i];
+    if (e->p == NULL || e->id == id) return e;
+  }
+}
+
+/*
+ * live_resize - Rehash the table into 1 << bits slots
+ */
+static void live_resize(live_table_t* t, int bits) {
+  live_t* old = t->slots;
+  size_t old_slots = (old != NULL) ? (size_t)1 << t->bits : 0;
+  if ((t->slots = (live_t*)calloc((size_t)1 << bits, sizeof(live_t))) ==
+      NULL) {
+    unix_error("calloc failed in live_resize");
+  }
+  t->bits = bits;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].p != NULL) *live_find(t, old[i].id) = old[i];
+  }
+  free(old);
+}
+
+/*
+ * live_insert - Record p as the block of id. The table is kept at most
+ *    half full.
+ */
+static void live_insert(live_table_t* t, uint32_t id, char* p, uint32_t size) {
+  if (2 * (t->count + 1) > (size_t)1 << t->bits) {
+    live_resize(t, t->bits + 1);
+  }
+  live_t* e = live_find(t, id);
+  if (e->p == NULL) t->count++;
+  e->id = id;
+  e->size = size;
+  e->p = p;
+}
+
+/*
+ * live_remove - Empty the slot e, and move back the entries after it that
+ *    would no longer be found past the hole
+ */
+static void live_remove(live_table_t* t, live_t* e) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  size_t hole = e - t->slots;
+  for (size_t i = (hole + 1) & mask; t->slots[i].p != NULL;
+       i = (i + 1) & mask) {
+    size_t home = live_hash(t, t->slots[i].id);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      t->slots[hole] = t->slots[i];
+      hole = i;
+    }
+  }
+  t->slots[hole].p = NULL;
+  t->count--;
+}
+
+/*
+ * eval_mm_stream - Replay every trace straight from its file, a chunk at a
+ *    time, and print its throughput and utilization as eval_mm_speed and
+ *    eval_mm_util would. Nothing is sized by the number of requests or of
+ *    ids, so the traces may be larger than memory.
+ */
+static void eval_mm_stream(const malloc_impl_t* impl, int n,
+                           char** tracefiles) {
+  char path[MAXLINE];
+
+  mem_init();
+  printf("%30s%12s%12s%12s%8s\n", "filename", "ops", "Kops/sec", "max live",
+         "util");
+  for (int i = 0; i < n; i++) {
+    trace_stream_t* s = NULL;
+    if (snprintf(path, MAXLINE, "%s%s", tracedir, tracefiles[i]) < MAXLINE) {
+      s = trace_stream_open(path);
+    } else {
+      errno = ENAMETOOLONG;
+    }
+    if (s == NULL) {
+      fprintf(stderr, "Could not open %s in eval_mm_stream: %s\n", path,
+              strerror(errno));
+      errors++;
+      printf("%30s%12d%12s\n", tracefiles[i], 0, "failed");
+      continue;
+    }
+
+    live_table_t live = {NULL, 0, 0};
+    live_resize(&live, 10);
+    uint64_t ops = 0, total_size = 0, max_total_size = 0;
+    size_t max_live = 0;
+    const traceop_t* chunk;
+    long num;
+    int failed = 0;
+
+    mem_reset_brk();
+    if (impl->init() < 0) {
+      app_error("init failed in eval_mm_stream");
+    }
+    num = trace_stream_next(s, &chunk); /* the first chunk is not timed */
+    double start = now_secs();
+    for (; !failed && num > 0; num = trace_stream_next(s, &chunk)) {
+      for (long k = 0; k < num; k++) {
+        const traceop_t* op = &chunk[k];
+        uint32_t id = (uint32_t)op->index;
+        live_t* e = live_find(&live, id);
+        char* p;
+        if ((op->type == ALLOC) != (e->p == NULL)) {
+          fprintf(stderr, "Request %" PRIu64 " in %s uses id %u, which is %s\n",
+                  ops, path, id,
+                  (e->p == NULL) ? "not allocated" : "already allocated");
+          failed = 1;
+          break;
+        }
+        switch (op->type) {
+          case ALLOC:
+            if ((p = (char*)impl->malloc(op->size)) == NULL) {
+              failed = 1;
+              break;
+            }
+            live_insert(&live, id, p, op->size);
+            total_size += op->size;
+            break;
+          case REALLOC:
+            if ((p = (char*)impl->realloc(e->p, op->size)) == NULL) {
+              failed = 1;
+              break;
+            }
+            total_size += (uint64_t)op->size - e->size;
+            e->p = p;
+            e->size = op->size;
+            break;
+          case FREE:
+            impl->free(e->p);
+            total_size -= e->size;
+            live_remove(&live, e);
+            break;
+          case WRITE:
+            p = e->p;
+            for (int offset = 1; offset < op->size; offset++) {
+              mem_op(p + offset - 1, p + offset);
+            }
+            break;
+          default:
+            app_error("Nonexistent request type in eval_mm_stream");
+        }
+        if (failed) break;
+        max_total_size =
+            (total_size > max_total_size) ? total_size : max_total_size;
+        max_live = (live.count > max_live) ? live.count : max_live;
+        ops++;
+      }
+    }
+    double secs = now_secs() - start;
+    if (!failed && num < 0) {
+      fprintf(stderr, "Could not read %s in eval_mm_stream\n", path);
+      failed = 1;
+    }
+    trace_stream_close(s);
+    free(live.slots);
+
+    if (failed) {
+      errors++;
+      printf("%30s%12" PRIu64 "%12s\n", tracefiles[i], ops, "failed");
+      continue;
+    }
+    max_total_size =
+        (max_total_size > MEM_ALLOWANCE) ? max_total_size : MEM_ALLOWANCE;
+    size_t heap_size = mem_heapsize();
+    heap_size = (heap_size > MEM_ALLOWANCE) ? heap_size : MEM_ALLOWANCE;
+    printf("%30s%12" PRIu64 "%12.0f%12zu%7.0f%%\n", tracefiles[i], ops,
+           (secs > 0) ? ops / secs / 1e3 : 0.0, max_live,
+           100.0 * max_total_size / heap_size);
+  }
+  mem_deinit();
+}
+
 /*
  * eval_mm_check - This function is used to check the heap of the student's
  *    implementation.  Returns 0 on check failure, and 1 on pass.
@@ -737,6 +1112,118 @@ static int eval_mm_check(const malloc_impl_t* impl, trace_t* trace,
   return 1;
 }
 
+/*
+ * bulk_fill - Fill size bytes at p with a pattern that depends on tag, and
+ *    bulk_filled - check that they still hold it.
+ */
+static void bulk_fill(char* p, size_t size, int tag) {
+  memset(p, (tag * 31 + 7) & 0xff, size);
+}
+
+static int bulk_filled(const char* p, size_t size, int tag) {
+  for (size_t i = 0; i < size; i++) {
+    if ((unsigned char)p[i] != ((tag * 31 + 7) & 0xff)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int bulk_error(char* msg) {
+  errors++;
+  printf("ERROR [bulk check]: %s\n", msg);
+  return 0;
+}
+
+/*
+ * eval_mm_bulk_check - No trace reaches the region or batch interfaces, so
+ *    exercise them directly. A region is filled with small objects and with
+ *    objects bigger than REGION_CHUNK / 4, then reset and refilled, then
+ *    destroyed. Batches of each size, and a batch of blocks of mixed sizes,
+ *    are allocated and freed. The caller allows mappings, so the largest
+ *    objects are mapped. The heap is checked after every step. Returns 0 on
+ *    failure, and 1 on pass.
+ */
+static int eval_mm_bulk_check(const malloc_impl_t* impl) {
+  static const size_t sizes[] = {1, 24, 200, 3000, 40000, 300000};
+  enum { NSIZES = sizeof(sizes) / sizeof(sizes[0]), NOBJS = 64 };
+  char* objs[NSIZES * NOBJS];
+  size_t lens[NSIZES * NOBJS];
+  int i, k, n, round;
+
+  mem_reset_brk();
+  if (impl->init() < 0) {
+    return bulk_error("impl init failed.");
+  }
+
+  region* r = my_region_create();
+  if (r == NULL) {
+    return bulk_error("my_region_create failed.");
+  }
+  for (round = 0; round < 3; round++) {
+    for (n = 0; n < NSIZES * NOBJS; n++) {
+      lens[n] = sizes[(n + n / NSIZES) % NSIZES];
+      if ((objs[n] = (char*)my_region_alloc(r, lens[n])) == NULL) {
+        return bulk_error("my_region_alloc failed.");
+      }
+      bulk_fill(objs[n], lens[n], n);
+    }
+    for (i = 0; i < n; i++) {
+      if (!bulk_filled(objs[i], lens[i], i)) {
+        return bulk_error("my_region_alloc returned overlapping objects.");
+      }
+    }
+    if (impl->check() < 0) {
+      return bulk_error("impl check failed after my_region_alloc.");
+    }
+    /* the last round leaves everything for my_region_destroy */
+    if (round < 2) {
+      my_region_reset(r);
+      if (impl->check() < 0) {
+        return bulk_error("impl check failed after my_region_reset.");
+      }
+    }
+  }
+  my_region_destroy(r);
+  if (impl->check() < 0) {
+    return bulk_error("impl check failed after my_region_destroy.");
+  }
+
+  for (k = 0; k < NSIZES; k++) {
+    n = my_malloc_batch(sizes[k], NOBJS, (void**)objs);
+    if (n != NOBJS) {
+      return bulk_error("my_malloc_batch came up short.");
+    }
+    for (i = 0; i < n; i++) {
+      bulk_fill(objs[i], sizes[k], i);
+    }
+    for (i = 0; i < n; i++) {
+      if (!bulk_filled(objs[i], sizes[k], i)) {
+        return bulk_error("my_malloc_batch returned overlapping blocks.");
+      }
+    }
+    if (impl->check() < 0) {
+      return bulk_error("impl check failed after my_malloc_batch.");
+    }
+    my_free_batch((void**)objs, n);
+    if (impl->check() < 0) {
+      return bulk_error("impl check failed after my_free_batch.");
+    }
+  }
+
+  /* blocks of mixed sizes, many of them neighbours, freed all at once */
+  for (n = 0; n < NSIZES * NOBJS; n++) {
+    if ((objs[n] = (char*)impl->malloc(sizes[n % NSIZES])) == NULL) {
+      return bulk_error("impl malloc failed.");
+    }
+  }
+  my_free_batch((void**)objs, n);
+  if (impl->check() < 0) {
+    return bulk_error("impl check failed after my_free_batch.");
+  }
+  return 1;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -811,13 +1298,17 @@ void malloc_error(int tracenum, int opnum, char* msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hvVgc] [-f <file>] [-t <dir>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hvVgcs] [-f <file>] [-t <dir>] [-j <n>]\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
   fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
   fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
   fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
   fprintf(stderr, "\t-V         Print additional debug info.\n");
-  fprintf(stderr, "\t-c         Check the heap after every operation.\n");
+  fprintf(stderr,
+          "\t-c         Check the heap after every operation and bulk call.\n");
+  fprintf(stderr, "\t-j <n>     Replay on 1, 2, 4, ... up to n threads.\n");
+  fprintf(stderr, "\t-s         Stream the traces instead of loading them.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
 }
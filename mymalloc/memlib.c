@@ -25,6 +25,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  // mremap
 #include "./memlib.h"
 
 #include <assert.h>
@@ -42,19 +43,31 @@
 static char* mem_start_brk; /* points to first byte of heap */
 static char* mem_brk;       /* points to first byte after the end of the heap */
 static char* mem_max_addr;  /* largest legal heap address */
+static char* mem_fresh_brk; /* highest mem_brk so far, zero from here on */
+static int mem_map_allowed; /* whether mem_map hands out real mappings */
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
   /* allocate the storage we will use to model the available VM */
+#if MEM_HUGE_PAGES
+  /* start on a huge page so the whole model heap can sit on huge pages */
+  if ((mem_start_brk = (char*)_mm_malloc(MAX_HEAP, MEM_HUGE_PAGE)) == NULL) {
+    fprintf(stderr, "mem_init_vm: malloc error\n");
+    exit(1);
+  }
+  madvise(mem_start_brk, MAX_HEAP, MADV_HUGEPAGE);
+#else
   if ((mem_start_brk = (char*)_mm_malloc(MAX_HEAP, 4096)) == NULL) {
     fprintf(stderr, "mem_init_vm: malloc error\n");
     exit(1);
   }
+#endif
 
   mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
   mem_brk = mem_start_brk;                 /* heap is empty initially */
+  mem_fresh_brk = mem_start_brk;
 
   memset(mem_start_brk, 0,
          MAX_HEAP); /* Zero out memory to prevent page faults */
@@ -75,8 +88,8 @@ void mem_reset_brk(void) { mem_brk = mem_start_brk; }
  *    by incr bytes and returns the start address of the new area. In
  *    this model, the heap cannot be shrunk.
  */
-void* mem_sbrk(unsigned int incr) {
-  if ((mem_brk + incr) > mem_max_addr) {
+void* mem_sbrk(size_t incr) {
+  if (incr > (size_t)(mem_max_addr - mem_brk)) {
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory... (%ld)\n",
             mem_heapsize());
@@ -84,6 +97,7 @@ void* mem_sbrk(unsigned int incr) {
   }
   char* old_brk = mem_brk;
   mem_brk += incr;
+  if (mem_brk > mem_fresh_brk) mem_fresh_brk = mem_brk;
   return (void*)old_brk;
 }
 
@@ -97,6 +111,13 @@ void* mem_heap_lo(void) { return (void*)mem_start_brk; }
  */
 void* mem_heap_hi(void) { return (void*)(mem_brk - 1); }
 
+/*
+ * mem_heap_fresh - returns the first byte the heap has never reached. The
+ *    heap is only zero from there on, since mem_reset_brk leaves whatever
+ *    the last run wrote below it.
+ */
+void* mem_heap_fresh(void) { return (void*)mem_fresh_brk; }
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -106,3 +127,59 @@ size_t mem_heapsize(void) { return (size_t)(mem_brk - mem_start_brk); }
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize(void) { return (size_t)getpagesize(); }
+
+/*
+ * mem_allow_map - let mem_map hand out real mappings. Space utilization is
+ *    only measured on the single simulated heap, so mappings are off unless
+ *    a caller, like the threaded replay, needs the allocator's other arenas.
+ */
+void mem_allow_map(int allow) { mem_map_allowed = allow; }
+
+/*
+ * mem_map - map a region outside the heap. The simulated memory system only
+ *    models a single contiguous heap, so unless mem_allow_map turned mappings
+ *    on this fails with ENOMEM and callers fall back to mem_sbrk.
+ */
+void* mem_map(size_t size) {
+  if (!mem_map_allowed) {
+    errno = ENOMEM;
+    return (void*)-1;
+  }
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return (ptr == MAP_FAILED) ? (void*)-1 : ptr;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map
+ */
+void mem_unmap(void* addr, size_t size) { munmap(addr, size); }
+
+/*
+ * mem_remap - resize a region returned by mem_map. Fails like mem_map
+ *    unless mappings are allowed.
+ */
+void* mem_remap(void* addr, size_t old_size, size_t new_size) {
+  if (!mem_map_allowed) {
+    errno = ENOMEM;
+    return (void*)-1;
+  }
+  void* ptr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  return (ptr == MAP_FAILED) ? (void*)-1 : ptr;
+}
+
+/*
+ * mem_trim - shrink the heap by decr bytes. In this model the heap cannot
+ *    be shrunk, so this always fails and returns -1.
+ */
+int mem_trim(size_t decr) { return -1; }
+
+/*
+ * mem_purge - tell the memory system the contents of [addr, addr + size)
+ *    are no longer needed. A no-op on the simulated heap, mapped regions
+ *    drop their pages.
+ */
+void mem_purge(void* addr, size_t size) {
+  if ((char*)addr >= mem_start_brk && (char*)addr < mem_max_addr) return;
+  madvise(addr, size, MADV_DONTNEED);
+}
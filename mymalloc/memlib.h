@@ -27,11 +27,18 @@
 
 void mem_init(void);
 void mem_deinit(void);
-void* mem_sbrk(unsigned int incr);
+void* mem_sbrk(size_t incr);
 void mem_reset_brk(void);
 void* mem_heap_lo(void);
 void* mem_heap_hi(void);
+void* mem_heap_fresh(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void mem_allow_map(int allow);
+void* mem_map(size_t size);
+void mem_unmap(void* addr, size_t size);
+void* mem_remap(void* addr, size_t old_size, size_t new_size);
+int mem_trim(size_t decr);
+void mem_purge(void* addr, size_t size);
 
 #endif  // MM_MEMLIB_H
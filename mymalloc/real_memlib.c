@@ -25,8 +25,10 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  // mremap
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,11 +42,84 @@
 static char* mem_start_brk; /* points to first byte of heap */
 static char* mem_brk;       /* points to first byte after the end of the heap */
 // static char* mem_max_addr;  /* largest legal heap address */
+static char* mem_fresh_brk; /* highest mem_brk so far, zero from here on */
+
+#if MEM_HUGE_PAGES
+static char* mem_max_addr;    /* end of the reservation, 0 on the sbrk heap */
+static char* mem_commit_brk;  /* end of the chunks mapped read-write */
+
+/*
+ * huge_map - map size bytes at an address aligned to MEM_HUGE_PAGE, by
+ *    mapping one huge page more and cutting the ends. Returns (void*)-1 on failure.
+ */
+static void* huge_map(size_t size, int prot) {
+  char* ptr = mmap(NULL, size + MEM_HUGE_PAGE, prot,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) return (void*)-1;
+  char* start = (char*)(((uintptr_t)ptr + MEM_HUGE_PAGE - 1) &
+                        ~(uintptr_t)(MEM_HUGE_PAGE - 1));
+  if (start > ptr) munmap(ptr, start - ptr);
+  munmap(start + size, ptr + MEM_HUGE_PAGE - start);
+  return start;
+}
+
+/*
+ * huge_commit - make [mem_commit_brk, end) usable, end being huge page
+ *    aligned. The chunk comes from the hugetlbfs pool when MEM_HUGE_PAGES is
+ *    2 and the pool has pages left, and is otherwise advised for transparent
+ *    huge pages.
+ */
+static int huge_commit(char* end) {
+  size_t len = end - mem_commit_brk;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#if MEM_HUGE_PAGES == 2
+  if (mmap(mem_commit_brk, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+           -1, 0) != MAP_FAILED) {
+    mem_commit_brk = end;
+    return 0;
+  }
+#endif
+  if (mmap(mem_commit_brk, len, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE,
+           -1, 0) == MAP_FAILED) {
+    return -1;
+  }
+  madvise(mem_commit_brk, len, MADV_HUGEPAGE);
+  mem_commit_brk = end;
+  return 0;
+}
+
+/*
+ * huge_decommit - give the chunks from end up back, leaving the range
+ *    reserved but inaccessible
+ */
+static void huge_decommit(char* end) {
+  if (end >= mem_commit_brk) return;
+  mmap(end, mem_commit_brk - end, PROT_NONE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  mem_commit_brk = end;
+}
+
+/* round p up to the next huge page */
+#define huge_up(p) \
+  ((char*)(((uintptr_t)(p) + MEM_HUGE_PAGE - 1) & ~(uintptr_t)(MEM_HUGE_PAGE - 1)))
+#endif
 
 /*
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. With MEM_HUGE_PAGES the heap
+ *    is a reservation of MEM_HUGE_RESERVE bytes that is mapped in huge page
+ *    chunks as it grows, or the sbrk heap if the reservation fails.
  */
-void mem_init(void) { mem_brk = mem_start_brk = sbrk(0); }
+void mem_init(void) {
+#if MEM_HUGE_PAGES
+  char* start = huge_map(MEM_HUGE_RESERVE, PROT_NONE);
+  if (start != (void*)-1) {
+    mem_fresh_brk = mem_brk = mem_start_brk = mem_commit_brk = start;
+    mem_max_addr = start + MEM_HUGE_RESERVE;
+    return;
+  }
+#endif
+  mem_fresh_brk = mem_brk = mem_start_brk = sbrk(0);
+}
 
 /*
  * mem_deinit - free the storage used by the memory system model
@@ -61,9 +136,31 @@ void mem_reset_brk(void) {}
  *    by incr bytes and returns the start address of the new area. In
  *    this model, the heap cannot be shrunk.
  */
-void* mem_sbrk(unsigned int incr) {
-  void* ptr = sbrk(incr);
-  mem_brk += incr;
+void* mem_sbrk(size_t incr) {
+#if MEM_HUGE_PAGES
+  if (mem_max_addr) {
+    if (incr > (size_t)(mem_max_addr - mem_brk)) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    char* old_brk = mem_brk;
+    if (mem_brk + incr > mem_commit_brk &&
+        huge_commit(huge_up(mem_brk + incr)) < 0) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    mem_brk += incr;
+    if (mem_brk > mem_fresh_brk) mem_fresh_brk = mem_brk;
+    return old_brk;
+  }
+#endif
+  if (incr > INTPTR_MAX) {
+    errno = ENOMEM;
+    return (void*)-1;
+  }
+  void* ptr = sbrk((intptr_t)incr);
+  if (ptr != (void*)-1) mem_brk += incr;
+  if (mem_brk > mem_fresh_brk) mem_fresh_brk = mem_brk;
   return ptr;
 }
 
@@ -77,6 +174,13 @@ void* mem_heap_lo(void) { return (void*)mem_start_brk; }
  */
 void* mem_heap_hi(void) { return (void*)(mem_brk - 1); }
 
+/*
+ * mem_heap_fresh - returns the first byte the heap has never reached. The
+ *    kernel hands out zero pages there, while memory given back by mem_trim
+ *    and taken again may still hold the tail of a page that stayed mapped.
+ */
+void* mem_heap_fresh(void) { return (void*)mem_fresh_brk; }
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -86,3 +190,70 @@ size_t mem_heapsize(void) { return (size_t)(mem_brk - mem_start_brk); }
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize(void) { return (size_t)getpagesize(); }
+
+/*
+ * mem_allow_map - mappings are always allowed on the real memory system
+ */
+void mem_allow_map(int allow) {}
+
+/*
+ * mem_map - map a zero-filled region of size bytes outside the brk heap.
+ *    Pages are only backed once they are touched, so callers may reserve
+ *    far more than they expect to use. Returns (void*)-1 on failure.
+ */
+void* mem_map(size_t size) {
+#if MEM_HUGE_PAGES
+  // arenas and large blocks start on a huge page and may use them throughout
+  if (size >= MEM_HUGE_PAGE) {
+    void* ptr = huge_map(size, PROT_READ | PROT_WRITE);
+    if (ptr != (void*)-1) madvise(ptr, size, MADV_HUGEPAGE);
+    return ptr;
+  }
+#endif
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return (ptr == MAP_FAILED) ? (void*)-1 : ptr;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map
+ */
+void mem_unmap(void* addr, size_t size) { munmap(addr, size); }
+
+/*
+ * mem_remap - grow or shrink a region returned by mem_map, moving it if the
+ *    address space after it is taken. The kernel moves the page tables, so
+ *    the contents are never copied. Returns (void*)-1 on failure.
+ */
+void* mem_remap(void* addr, size_t old_size, size_t new_size) {
+  void* ptr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  return (ptr == MAP_FAILED) ? (void*)-1 : ptr;
+}
+
+/*
+ * mem_trim - shrink the heap by decr bytes, handing the pages above the new
+ *    brk back to the kernel. Fails and returns -1 if something else moved the
+ *    brk since our last mem_sbrk, since the top of the heap is not ours then.
+ *    The huge page heap only unmaps the whole chunks above the new brk.
+ */
+int mem_trim(size_t decr) {
+#if MEM_HUGE_PAGES
+  if (mem_max_addr) {
+    if (decr > (size_t)(mem_brk - mem_start_brk)) return -1;
+    mem_brk -= decr;
+    huge_decommit(huge_up(mem_brk));
+    return 0;
+  }
+#endif
+  if (sbrk(0) != mem_brk || decr > (size_t)(mem_brk - mem_start_brk)) return -1;
+  if (sbrk(-(intptr_t)decr) == (void*)-1) return -1;
+  mem_brk -= decr;
+  return 0;
+}
+
+/*
+ * mem_purge - drop the pages in [addr, addr + size) from the resident set.
+ *    The range stays mapped and reads back as zeros. addr and size must be
+ *    page aligned.
+ */
+void mem_purge(void* addr, size_t size) { madvise(addr, size, MADV_DONTNEED); }
@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+#include "./region.h"
+
+#include <stdint.h>
+
+#include "./allocator.h"
+#include "./allocator_interface.h"
+
+// a region bump allocates out of chunks it takes from my_malloc, linked
+// newest first. objects carry no header, so nothing can be freed on its own,
+// and resetting or destroying the region frees the chunks instead. the region
+// itself lives at the start of its first chunk, which is kept across resets.
+typedef struct region_chunk {
+  struct region_chunk* next;
+} region_chunk;
+
+struct region {
+  region_chunk* chunks;
+  char* cur;
+  char* end;
+};
+
+#define CHUNK_HEADER ALIGN(sizeof(region_chunk))
+#define REGION_HEADER ALIGN(sizeof(region))
+
+// requests bigger than this get a chunk of their own, so they never waste
+// the rest of the chunk being bumped
+#define REGION_LARGE (REGION_CHUNK / 4)
+
+// first chunk of r, the one holding r
+#define first_chunk(r) ((region_chunk*)((char*)(r) - CHUNK_HEADER))
+
+region* my_region_create(void) {
+  region_chunk* c = (region_chunk*)my_malloc(REGION_CHUNK);
+  if (c == NULL) return NULL;
+  c->next = NULL;
+  region* r = (region*)((char*)c + CHUNK_HEADER);
+  r->chunks = c;
+  r->cur = (char*)r + REGION_HEADER;
+  r->end = (char*)c + REGION_CHUNK;
+  return r;
+}
+
+// make room for size bytes that do not fit in the current chunk
+static void* region_grow(region* r, size_t size) {
+  if (size > REGION_LARGE) {
+    // link it behind the chunk being bumped, which keeps its free space
+    region_chunk* c = (region_chunk*)my_malloc(CHUNK_HEADER + size);
+    if (c == NULL) return NULL;
+    c->next = r->chunks->next;
+    r->chunks->next = c;
+    return (char*)c + CHUNK_HEADER;
+  }
+  region_chunk* c = (region_chunk*)my_malloc(REGION_CHUNK);
+  if (c == NULL) return NULL;
+  c->next = r->chunks;
+  r->chunks = c;
+  r->cur = (char*)c + CHUNK_HEADER + size;
+  r->end = (char*)c + REGION_CHUNK;
+  return (char*)c + CHUNK_HEADER;
+}
+
+void* my_region_alloc(region* r, size_t size) {
+  if (size > SIZE_MAX - CHUNK_HEADER - ALIGNMENT) return NULL;
+  size = size ? ALIGN(size) : ALIGNMENT;
+  if (size <= (size_t)(r->end - r->cur)) {
+    void* p = r->cur;
+    r->cur += size;
+    return p;
+  }
+  return region_grow(r, size);
+}
+
+// free every chunk on the list from c on, except the first chunk of r
+static void region_free_chunks(region* r, region_chunk* c) {
+  void* batch[64];
+  size_t n = 0;
+  for (region_chunk* next; c != NULL; c = next) {
+    next = c->next;
+    if (c == first_chunk(r)) continue;
+    batch[n++] = c;
+    if (n == sizeof(batch) / sizeof(batch[0])) {
+      my_free_batch(batch, n);
+      n = 0;
+    }
+  }
+  if (n) my_free_batch(batch, n);
+}
+
+void my_region_reset(region* r) {
+  region_chunk* first = first_chunk(r);
+  region_free_chunks(r, r->chunks);
+  first->next = NULL;
+  r->chunks = first;
+  r->cur = (char*)r + REGION_HEADER;
+  r->end = (char*)first + REGION_CHUNK;
+}
+
+void my_region_destroy(region* r) {
+  if (r == NULL) return;
+  region_free_chunks(r, r->chunks);
+  my_free(first_chunk(r));
+}
@@ -0,0 +1,513 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+#include "./trace.h"
+
+#include "./config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * trace_alloc_blocks - allocate the arrays the replay keeps its blocks in
+ */
+static int trace_alloc_blocks(trace_t* trace) {
+  trace->blocks = (char**)malloc(trace->num_ids * sizeof(char*));
+  trace->block_sizes = (size_t*)malloc(trace->num_ids * sizeof(size_t));
+  return (trace->blocks == NULL || trace->block_sizes == NULL) ? -1 : 0;
+}
+
+/*
+ * trace_parse_op - read the next request of a text trace into op. "t n"
+ *    lines tag the requests after them with thread n, which *thread keeps
+ *    from one call to the next. Returns 1 for a request, 0 at the end of
+ *    the file and -1 on a malformed line.
+ */
+static int trace_parse_op(FILE* tracefile, const char* path, unsigned* thread,
+                          traceop_t* op) {
+  char type[1024];
+  unsigned index, size = 0;
+
+  while (fscanf(tracefile, "%1023s", type) != EOF) {
+    if (type[0] == 't') {
+      if (fscanf(tracefile, "%u", thread) != 1) break;
+      continue;
+    }
+    switch (type[0]) {
+      case 'a':
+        if (fscanf(tracefile, "%u %u", &index, &size) != 2) goto bad;
+        op->type = ALLOC;
+        break;
+      case 'r':
+        if (fscanf(tracefile, "%u %u", &index, &size) != 2) goto bad;
+        op->type = REALLOC;
+        break;
+      case 'f':
+        if (fscanf(tracefile, "%ud", &index) != 1) goto bad;
+        op->type = FREE;
+        break;
+      case 'w':
+        if (fscanf(tracefile, "%u %u", &index, &size) != 2) goto bad;
+        op->type = WRITE;
+        break;
+      default:
+        fprintf(stderr, "Bogus type character (%c) in tracefile %s\n",
+                type[0], path);
+        return -1;
+    }
+    op->index = index;
+    op->size = size;
+    op->thread = *thread;
+    return 1;
+  }
+  return 0;
+
+bad:
+  fprintf(stderr, "Bad %c request in tracefile %s\n", type[0], path);
+  return -1;
+}
+
+/*
+ * trace_check_ops - Check that every request of trace can be replayed: its
+ *    type is known, its id indexes the block arrays, and its size and
+ *    thread are in range. Binary traces are used in place, so nothing else
+ *    looks at a request before the replay does.
+ */
+static int trace_check_ops(const trace_t* trace, const char* path) {
+  for (int i = 0; i < trace->num_ops; i++) {
+    const traceop_t* op = &trace->ops[i];
+    if ((unsigned)op->type > WRITE || op->index < 0 ||
+        op->index >= trace->num_ids || op->size < 0 || op->thread < 0 ||
+        op->thread >= trace->num_threads) {
+      fprintf(stderr, "Bad request %d in tracefile %s\n", i, path);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * trace_load_text - parse a text trace: four header numbers, then one
+ *    request per line, "a id size", "r id size", "f id" or "w id size",
+ *    and "t n" lines that tag the requests after them with thread n.
+ */
+static trace_t* trace_load_text(FILE* tracefile, const char* path) {
+  trace_t* trace;
+  traceop_t op;
+  int ret;
+  unsigned max_index = 0;
+  unsigned op_index = 0;
+  unsigned thread = 0;
+
+  if ((trace = (trace_t*)calloc(1, sizeof(trace_t))) == NULL) {
+    return NULL;
+  }
+  if (fscanf(tracefile, "%d %d %d %d", &trace->sugg_heapsize,
+             &trace->num_ids, &trace->num_ops, &trace->weight) != 4 ||
+      trace->num_ids < 0 || trace->num_ops < 0) {
+    fprintf(stderr, "Bad header in tracefile %s\n", path);
+    goto fail;
+  }
+  trace->num_threads = 1;
+
+  if ((trace->ops = (traceop_t*)malloc(trace->num_ops * sizeof(traceop_t))) ==
+          NULL ||
+      trace_alloc_blocks(trace) < 0) {
+    goto fail;
+  }
+
+  while ((ret = trace_parse_op(tracefile, path, &thread, &op)) > 0) {
+    if (op_index >= (unsigned)trace->num_ops) {
+      fprintf(stderr, "More than %d requests in tracefile %s\n",
+              trace->num_ops, path);
+      goto fail;
+    }
+    if (op.type != FREE && op.type != WRITE &&
+        (unsigned)op.index > max_index) {
+      max_index = op.index;
+    }
+    if (op.thread >= trace->num_threads) {
+      trace->num_threads = op.thread + 1;
+    }
+    trace->ops[op_index++] = op;
+  }
+  if (ret < 0) goto fail;
+  if ((int)max_index != trace->num_ids - 1 ||
+      (int)op_index != trace->num_ops) {
+    fprintf(stderr, "Tracefile %s does not match its header\n", path);
+    goto fail;
+  }
+  if (trace_check_ops(trace, path) < 0) goto fail;
+  return trace;
+
+fail:
+  trace_free(trace);
+  errno = EINVAL;
+  return NULL;
+}
+
+/*
+ * trace_check_header - Check that hdr describes a binary trace this build
+ *    can replay
+ */
+static int trace_check_header(const trace_header_t* hdr, const char* path) {
+  if (hdr->version != TRACE_VERSION || hdr->byte_order != TRACE_BYTE_ORDER ||
+      hdr->op_size != sizeof(traceop_t) || hdr->num_ops < 0 ||
+      hdr->num_ids < 0) {
+    fprintf(stderr, "Tracefile %s is not a version %d trace for this machine\n",
+            path, TRACE_VERSION);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * trace_load_binary - map a binary trace. The requests are used in place,
+ *    only the block arrays are allocated.
+ */
+static trace_t* trace_load_binary(int fd, const char* path) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) return NULL;
+  size_t len = st.st_size;
+  if (len < sizeof(trace_header_t)) {
+    fprintf(stderr, "Tracefile %s is truncated\n", path);
+    errno = EINVAL;
+    return NULL;
+  }
+  void* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return NULL;
+  madvise(map, len, MADV_SEQUENTIAL);
+
+  const trace_header_t* hdr = (const trace_header_t*)map;
+  if (trace_check_header(hdr, path) < 0) {
+    munmap(map, len);
+    return NULL;
+  }
+  if ((len - sizeof(trace_header_t)) / sizeof(traceop_t) <
+      (size_t)hdr->num_ops) {
+    fprintf(stderr, "Tracefile %s is truncated\n", path);
+    munmap(map, len);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  trace_t* trace = (trace_t*)calloc(1, sizeof(trace_t));
+  if (trace == NULL) {
+    munmap(map, len);
+    return NULL;
+  }
+  trace->map = map;
+  trace->map_len = len;
+  trace->sugg_heapsize = hdr->sugg_heapsize;
+  trace->num_ids = hdr->num_ids;
+  trace->num_ops = hdr->num_ops;
+  trace->weight = hdr->weight;
+  trace->num_threads = hdr->num_threads;
+  trace->ops = (traceop_t*)((char*)map + sizeof(trace_header_t));
+  if (trace_check_ops(trace, path) < 0 || trace_alloc_blocks(trace) < 0) {
+    int err = errno;
+    trace_free(trace);
+    errno = err;
+    return NULL;
+  }
+  return trace;
+}
+
+/*
+ * trace_load - read the trace at path, which may be a text or a binary
+ *    trace. Returns NULL with errno set if it cannot be read.
+ */
+trace_t* trace_load(const char* path) {
+  char magic[sizeof(((trace_header_t*)0)->magic)];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  ssize_t n = read(fd, magic, sizeof(magic));
+  if (n == (ssize_t)sizeof(magic) &&
+      memcmp(magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+    trace_t* trace = trace_load_binary(fd, path);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return trace;
+  }
+
+  lseek(fd, 0, SEEK_SET);
+  FILE* tracefile = fdopen(fd, "r");
+  if (tracefile == NULL) {
+    close(fd);
+    return NULL;
+  }
+  trace_t* trace = trace_load_text(tracefile, path);
+  int err = errno;
+  fclose(tracefile);
+  errno = err;
+  return trace;
+}
+
+/*
+ * trace_write_binary - write trace to path as a binary trace. Returns -1
+ *    with errno set on failure.
+ */
+int trace_write_binary(const trace_t* trace, const char* path) {
+  trace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  hdr.version = TRACE_VERSION;
+  hdr.byte_order = TRACE_BYTE_ORDER;
+  hdr.op_size = sizeof(traceop_t);
+  hdr.sugg_heapsize = trace->sugg_heapsize;
+  hdr.num_ids = trace->num_ids;
+  hdr.num_ops = trace->num_ops;
+  hdr.weight = trace->weight;
+  hdr.num_threads = trace->num_threads;
+
+  FILE* out = fopen(path, "wb");
+  if (out == NULL) return -1;
+  if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+      fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out) !=
+          (size_t)trace->num_ops) {
+    int err = errno;
+    fclose(out);
+    errno = err;
+    return -1;
+  }
+  return fclose(out);
+}
+
+/*
+ * trace_free - Free the trace record and the arrays it points to, and
+ *    unmap the file of a binary trace.
+ */
+void trace_free(trace_t* trace) {
+  if (trace == NULL) return;
+  if (trace->map != NULL) {
+    munmap(trace->map, trace->map_len);
+  } else {
+    free(trace->ops);
+  }
+  free(trace->blocks);
+  free(trace->block_sizes);
+  free(trace);
+}
+
+/*
+ * A trace read a chunk at a time. The reader thread fills one buffer while
+ * the replay works through the other, so parsing and disk reads overlap
+ * with the allocator calls and only two chunks are ever in memory.
+ */
+struct trace_stream {
+  char* path;
+  int fd;            /* binary trace, or -1 */
+  FILE* text;        /* text trace, or NULL */
+  unsigned thread;   /* current thread tag of a text trace */
+  traceop_t* buf[2];
+  long count[2];     /* requests in each full buffer, 0 past the end */
+  int full[2];       /* buffer is ready for the replay */
+  int next;          /* buffer the replay takes next */
+  int held;          /* buffer the replay is working through, or -1 */
+  int error;         /* the reader hit a bad or unreadable request */
+  int stop;          /* the replay is closing the stream */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t reader;
+};
+
+/*
+ * stream_fill - read up to TRACE_CHUNK requests into buf. Returns how many
+ *    were read, or -1 on error.
+ */
+static long stream_fill(trace_stream_t* s, traceop_t* buf) {
+  long n = 0;
+  if (s->text != NULL) {
+    int ret = 0;
+    while (n < TRACE_CHUNK &&
+           (ret = trace_parse_op(s->text, s->path, &s->thread, &buf[n])) > 0) {
+      n++;
+    }
+    return (ret < 0) ? -1 : n;
+  }
+
+  size_t want = TRACE_CHUNK * sizeof(traceop_t);
+  size_t got = 0;
+  while (got < want) {
+    ssize_t r = read(s->fd, (char*)buf + got, want - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return -1;
+    if (r == 0) break;
+    got += r;
+  }
+  if (got % sizeof(traceop_t) != 0) {
+    fprintf(stderr, "Tracefile %s is truncated\n", s->path);
+    return -1;
+  }
+  return got / sizeof(traceop_t);
+}
+
+/*
+ * stream_reader - Fill the two buffers in turn until the end of the trace,
+ *    which is handed over as a full buffer of no requests.
+ */
+static void* stream_reader(void* arg) {
+  trace_stream_t* s = (trace_stream_t*)arg;
+  int k = 0;
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (s->full[k] && !s->stop) {
+      pthread_cond_wait(&s->cond, &s->lock);
+    }
+    int stop = s->stop;
+    pthread_mutex_unlock(&s->lock);
+    if (stop) break;
+
+    long n = stream_fill(s, s->buf[k]);
+
+    pthread_mutex_lock(&s->lock);
+    s->count[k] = (n < 0) ? 0 : n;
+    s->error = (n < 0);
+    s->full[k] = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    if (n <= 0) break;
+    k ^= 1;
+  }
+  return NULL;
+}
+
+/*
+ * trace_stream_open - Open the text or binary trace at path for streaming
+ *    and start reading ahead. Returns NULL with errno set on failure.
+ */
+trace_stream_t* trace_stream_open(const char* path) {
+  trace_stream_t* s = (trace_stream_t*)calloc(1, sizeof(trace_stream_t));
+  if (s == NULL) return NULL;
+  s->fd = -1;
+  s->held = -1;
+  s->path = strdup(path);
+  s->buf[0] = (traceop_t*)malloc(TRACE_CHUNK * sizeof(traceop_t));
+  s->buf[1] = (traceop_t*)malloc(TRACE_CHUNK * sizeof(traceop_t));
+  if (s->path == NULL || s->buf[0] == NULL || s->buf[1] == NULL) goto fail;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) goto fail;
+  trace_header_t hdr;
+  ssize_t n = read(fd, &hdr, sizeof(hdr));
+  if (n == (ssize_t)sizeof(hdr) &&
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+    s->fd = fd;
+    if (trace_check_header(&hdr, path) < 0) goto fail;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  } else {
+    /* the header counts are not needed, and may not fit an int */
+    long long sugg_heapsize, num_ids, num_ops, weight;
+    lseek(fd, 0, SEEK_SET);
+    if ((s->text = fdopen(fd, "r")) == NULL) {
+      close(fd);
+      goto fail;
+    }
+    if (fscanf(s->text, "%lld %lld %lld %lld", &sugg_heapsize, &num_ids,
+               &num_ops, &weight) != 4) {
+      fprintf(stderr, "Bad header in tracefile %s\n", path);
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  if ((errno = pthread_create(&s->reader, NULL, stream_reader, s)) != 0) {
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    goto fail;
+  }
+  return s;
+
+fail: {
+  int err = errno;
+  if (s->text != NULL) fclose(s->text);
+  if (s->fd >= 0) close(s->fd);
+  free(s->buf[0]);
+  free(s->buf[1]);
+  free(s->path);
+  free(s);
+  errno = err;
+  return NULL;
+}
+}
+
+/*
+ * trace_stream_next - Hand back the chunk returned by the previous call and
+ *    point *ops at the next one. Returns the number of requests in it, 0 at
+ *    the end of the trace and -1 if the trace could not be read.
+ */
+long trace_stream_next(trace_stream_t* s, const traceop_t** ops) {
+  pthread_mutex_lock(&s->lock);
+  if (s->held >= 0) {
+    s->full[s->held] = 0;
+    s->held = -1;
+    pthread_cond_broadcast(&s->cond);
+  }
+  while (!s->full[s->next]) {
+    pthread_cond_wait(&s->cond, &s->lock);
+  }
+  long n = s->count[s->next];
+  if (n == 0) {
+    /* the end stays full, so every later call returns it again */
+    n = s->error ? -1 : 0;
+  } else {
+    *ops = s->buf[s->next];
+    s->held = s->next;
+    s->next ^= 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return n;
+}
+
+/*
+ * trace_stream_close - Stop the reader and free the stream
+ */
+void trace_stream_close(trace_stream_t* s) {
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->reader, NULL);
+  pthread_cond_destroy(&s->cond);
+  pthread_mutex_destroy(&s->lock);
+  if (s->text != NULL) {
+    fclose(s->text);
+  } else {
+    close(s->fd);
+  }
+  free(s->buf[0]);
+  free(s->buf[1]);
+  free(s->path);
+  free(s);
+}
@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/**
+ * trace.h
+ *
+ * Allocator traces as replayed by mdriver, and the text and binary files
+ * they are stored in.
+ **/
+
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { ALLOC, FREE, REALLOC, WRITE } traceop_type; /* type of request */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+  traceop_type type; /* type of request */
+  int index;         /* index for free() to use later */
+  int size;          /* byte size of alloc/realloc request */
+  int thread;        /* thread that issues the request, set by "t" lines */
+} traceop_t;
+
+/* Holds the information for one trace file*/
+typedef struct {
+  int sugg_heapsize;   /* suggested heap size (unused) */
+  int num_ids;         /* number of alloc/realloc ids */
+  int num_ops;         /* number of distinct requests */
+  int weight;          /* weight for this trace (unused) */
+  int num_threads;     /* 1 + the highest thread tag in the trace */
+  traceop_t* ops;      /* array of requests */
+  char** blocks;       /* array of ptrs returned by malloc/realloc... */
+  size_t* block_sizes; /* ... and a corresponding array of payload sizes */
+  void* map;           /* mapping of a binary trace file, or NULL */
+  size_t map_len;
+} trace_t;
+
+/*
+ * A binary trace is this header followed by num_ops traceop_t records,
+ * exactly as they are laid out in memory, so a loaded trace replays straight
+ * out of the mapped file. The records are in the byte order and layout of
+ * the machine that wrote them; byte_order and op_size reject any other.
+ */
+#define TRACE_MAGIC "MMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304
+
+typedef struct {
+  char magic[8];       /* TRACE_MAGIC */
+  uint32_t version;    /* TRACE_VERSION */
+  uint32_t byte_order; /* TRACE_BYTE_ORDER as written */
+  uint32_t op_size;    /* sizeof(traceop_t) */
+  int32_t sugg_heapsize;
+  int32_t num_ids;
+  int32_t num_ops;
+  int32_t weight;
+  int32_t num_threads;
+} trace_header_t;
+
+trace_t* trace_load(const char* path);
+int trace_write_binary(const trace_t* trace, const char* path);
+void trace_free(trace_t* trace);
+
+/*
+ * A trace replayed a chunk of TRACE_CHUNK requests at a time, for traces
+ * too large to load. Ids are read as unsigned 32-bit numbers.
+ */
+typedef struct trace_stream trace_stream_t;
+
+trace_stream_t* trace_stream_open(const char* path);
+long trace_stream_next(trace_stream_t* s, const traceop_t** ops);
+void trace_stream_close(trace_stream_t* s);
+
+#endif  // MM_TRACE_H
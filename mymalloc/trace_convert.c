@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/*
+ * trace_convert - write a text trace, or a binary one, as a binary trace
+ *    that mdriver maps instead of parsing.
+ *
+ *    usage: trace_convert <in> <out>
+ */
+
+#include <stdio.h>
+
+#include "./trace.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: trace_convert <in> <out>\n");
+    return 1;
+  }
+  trace_t* trace = trace_load(argv[1]);
+  if (trace == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (trace_write_binary(trace, argv[2]) < 0) {
+    perror(argv[2]);
+    trace_free(trace);
+    return 1;
+  }
+  trace_free(trace);
+  return 0;
+}
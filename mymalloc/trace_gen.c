@@ -0,0 +1,566 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/*
+ * trace_gen - generate an mdriver trace from a workload spec
+ *
+ *    usage: trace_gen [-b] [-s <seed>] [-x <scale>] <spec> <out>
+ *
+ *    -b writes the binary trace format, -s overrides the seed of the spec
+ *    and -x multiplies its scale. The same spec and seed always give the
+ *    same trace.
+ *
+ * A spec is a list of settings, one per line, "#" starting a comment:
+ *
+ *    seed 42
+ *    scale 10            # multiplies the ops and the live heap of phases
+ *    threads 4           # requests are tagged with threads 0..3
+ *    phase               # starts a phase; the settings below are its own
+ *    ops 200000          # requests in the phase
+ *    live 4M             # target live heap, in payload bytes
+ *    size uniform 16 512
+ *    life exp 2000       # lifetime in requests
+ *    realloc 0.1 2 4     # 10% of blocks are resized 4 times, x2 each time,
+ *                        # spread over their lifetime
+ *    handoff 0.3         # 30% of blocks are freed by another thread
+ *    phase
+ *    ...
+ *
+ * Each phase starts with the settings of the one before, and blocks live at
+ * the end of a phase carry over into the next. Everything still live at the
+ * end of the last phase is freed.
+ *
+ *    size fixed <n>                  every block n bytes
+ *    size uniform <lo> <hi>
+ *    size powerlaw <lo> <hi> <alpha> density proportional to size^-alpha
+ *    size bimodal <a> <b> <p>        a bytes with probability p, else b
+ *    size hist <size>:<weight> ...   an empirical histogram
+ *    life fixed <n>
+ *    life uniform <lo> <hi>
+ *    life exp <mean>
+ *    life forever                    freed only to stay under the target
+ *
+ * Sizes take a K, M or G suffix. New blocks are allocated while the live
+ * heap is under its target; at the target, the block due to die first is
+ * freed early.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./trace.h"
+
+#define MAX_HIST 64
+
+// requests between the resizes of a block that lives forever
+#define REALLOC_GAP 1000
+
+typedef enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_POWERLAW, SIZE_BIMODAL, SIZE_HIST } size_kind;
+typedef enum { LIFE_FIXED, LIFE_UNIFORM, LIFE_EXP, LIFE_FOREVER } life_kind;
+
+// the settings of one phase
+typedef struct {
+  uint64_t ops;
+  uint64_t live;
+  size_kind size;
+  double size_a, size_b, size_c;
+  int hist_count;
+  uint64_t hist_size[MAX_HIST];
+  double hist_weight[MAX_HIST];  // cumulative
+  life_kind life;
+  double life_a, life_b;
+  double realloc_p, realloc_growth;
+  int realloc_steps;
+  double handoff;
+} phase_t;
+
+// a live block, with the next request due on it
+typedef struct {
+  uint64_t id;
+  uint64_t size;
+  uint64_t due;    // request number of the next resize or the free
+  uint64_t death;  // request number of the free
+  int steps;       // resizes still to come
+  int thread;      // thread that allocated it, and resizes it
+} block_t;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+  uint64_t x = rng_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng_state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+// uniform in [0, 1)
+static double rng_unit(void) {
+  return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char* spec_path;
+static int spec_line;
+
+static void spec_error(const char* what) {
+  fprintf(stderr, "%s:%d: %s\n", spec_path, spec_line, what);
+  exit(1);
+}
+
+// a byte count with an optional K, M or G suffix
+static uint64_t parse_size(const char* s) {
+  char* end;
+  if (s == NULL) spec_error("missing number");
+  double v = strtod(s, &end);
+  if (end == s || v < 0) spec_error("bad number");
+  switch (*end) {
+    case 'k': case 'K': v *= 1 << 10; end++; break;
+    case 'm': case 'M': v *= 1 << 20; end++; break;
+    case 'g': case 'G': v *= 1 << 30; end++; break;
+  }
+  if (*end != '\0') spec_error("bad number");
+  return (uint64_t)v;
+}
+
+static double parse_real(const char* s) {
+  char* end;
+  if (s == NULL) spec_error("missing number");
+  double v = strtod(s, &end);
+  if (end == s || *end != '\0') spec_error("bad number");
+  return v;
+}
+
+/*
+ * parse_spec - read the spec at path into phases, returning how many there
+ *    are. The seed, scale and threads settings go to the pointers.
+ */
+static int parse_spec(const char* path, phase_t** phases, uint64_t* seed,
+                      double* scale, int* threads) {
+  char line[4096];
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  spec_path = path;
+
+  // the settings before the first phase are the defaults of every phase
+  phase_t cur = {.ops = 100000,
+                 .live = 1 << 20,
+                 .size = SIZE_UNIFORM,
+                 .size_a = 16,
+                 .size_b = 1024,
+                 .life = LIFE_EXP,
+                 .life_a = 1000,
+                 .realloc_growth = 2,
+                 .realloc_steps = 1};
+  int n = 0, started = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    spec_line++;
+    char* hash = strchr(line, '#');
+    if (hash != NULL) *hash = '\0';
+    char* key = strtok(line, " \t\r\n");
+    if (key == NULL) continue;
+    char* a = strtok(NULL, " \t\r\n");
+    char* b = strtok(NULL, " \t\r\n");
+    char* c = strtok(NULL, " \t\r\n");
+
+    if (strcmp(key, "phase") == 0) {
+      if (started) {
+        *phases = (phase_t*)realloc(*phases, (n + 1) * sizeof(phase_t));
+        (*phases)[n++] = cur;
+      }
+      started = 1;
+    } else if (strcmp(key, "seed") == 0) {
+      *seed = parse_size(a);
+    } else if (strcmp(key, "scale") == 0) {
+      *scale = parse_real(a);
+      if (*scale <= 0) spec_error("scale must be positive");
+    } else if (strcmp(key, "threads") == 0) {
+      *threads = (int)parse_size(a);
+      if (*threads < 1) spec_error("need at least one thread");
+    } else if (strcmp(key, "ops") == 0) {
+      cur.ops = parse_size(a);
+    } else if (strcmp(key, "live") == 0) {
+      cur.live = parse_size(a);
+    } else if (strcmp(key, "size") == 0) {
+      if (a == NULL) spec_error("missing size distribution");
+      if (strcmp(a, "fixed") == 0) {
+        cur.size = SIZE_FIXED;
+        cur.size_a = parse_size(b);
+      } else if (strcmp(a, "uniform") == 0) {
+        cur.size = SIZE_UNIFORM;
+        cur.size_a = parse_size(b);
+        cur.size_b = parse_size(c);
+      } else if (strcmp(a, "powerlaw") == 0) {
+        cur.size = SIZE_POWERLAW;
+        cur.size_a = parse_size(b);
+        cur.size_b = parse_size(c);
+        cur.size_c = parse_real(strtok(NULL, " \t\r\n"));
+        if (cur.size_a < 1) spec_error("powerlaw sizes start at 1");
+      } else if (strcmp(a, "bimodal") == 0) {
+        cur.size = SIZE_BIMODAL;
+        cur.size_a = parse_size(b);
+        cur.size_b = parse_size(c);
+        cur.size_c = parse_real(strtok(NULL, " \t\r\n"));
+      } else if (strcmp(a, "hist") == 0) {
+        cur.size = SIZE_HIST;
+        cur.hist_count = 0;
+        double total = 0;
+        for (char* bin = b; bin != NULL; bin = c, c = strtok(NULL, " \t\r\n")) {
+          char* colon = strchr(bin, ':');
+          if (colon == NULL) spec_error("histogram bins are size:weight");
+          if (cur.hist_count == MAX_HIST) spec_error("too many histogram bins");
+          *colon = '\0';
+          cur.hist_size[cur.hist_count] = parse_size(bin);
+          total += parse_real(colon + 1);
+          cur.hist_weight[cur.hist_count++] = total;
+        }
+        if (cur.hist_count == 0 || total <= 0) spec_error("empty histogram");
+      } else {
+        spec_error("unknown size distribution");
+      }
+      if (cur.size != SIZE_HIST && cur.size != SIZE_FIXED &&
+          cur.size != SIZE_BIMODAL && cur.size_b < cur.size_a) {
+        spec_error("size range is backwards");
+      }
+    } else if (strcmp(key, "life") == 0) {
+      if (a == NULL) spec_error("missing lifetime distribution");
+      if (strcmp(a, "fixed") == 0) {
+        cur.life = LIFE_FIXED;
+        cur.life_a = parse_real(b);
+      } else if (strcmp(a, "uniform") == 0) {
+        cur.life = LIFE_UNIFORM;
+        cur.life_a = parse_real(b);
+        cur.life_b = parse_real(c);
+      } else if (strcmp(a, "exp") == 0) {
+        cur.life = LIFE_EXP;
+        cur.life_a = parse_real(b);
+      } else if (strcmp(a, "forever") == 0) {
+        cur.life = LIFE_FOREVER;
+      } else {
+        spec_error("unknown lifetime distribution");
+      }
+    } else if (strcmp(key, "realloc") == 0) {
+      cur.realloc_p = parse_real(a);
+      cur.realloc_growth = parse_real(b);
+      cur.realloc_steps = (int)parse_size(c);
+    } else if (strcmp(key, "handoff") == 0) {
+      cur.handoff = parse_real(a);
+    } else {
+      spec_error("unknown setting");
+    }
+  }
+  fclose(f);
+  *phases = (phase_t*)realloc(*phases, (n + 1) * sizeof(phase_t));
+  (*phases)[n++] = cur;
+  return n;
+}
+
+static uint64_t draw_size(const phase_t* p) {
+  double u = rng_unit();
+  double s;
+  switch (p->size) {
+    case SIZE_FIXED:
+      return (uint64_t)p->size_a;
+    case SIZE_UNIFORM:
+      return (uint64_t)p->size_a +
+             rng_next() % ((uint64_t)p->size_b - (uint64_t)p->size_a + 1);
+    case SIZE_POWERLAW:
+      // inverse of the CDF of a power law truncated to [size_a, size_b]
+      if (fabs(p->size_c - 1) < 1e-9) {
+        s = p->size_a * pow(p->size_b / p->size_a, u);
+      } else {
+        double e = 1 - p->size_c;
+        double lo = pow(p->size_a, e), hi = pow(p->size_b, e);
+        s = pow(lo + u * (hi - lo), 1 / e);
+      }
+      return (uint64_t)s;
+    case SIZE_BIMODAL:
+      return (uint64_t)((u < p->size_c) ? p->size_a : p->size_b);
+    case SIZE_HIST:
+      u *= p->hist_weight[p->hist_count - 1];
+      for (int i = 0; i < p->hist_count; i++) {
+        if (u < p->hist_weight[i]) return p->hist_size[i];
+      }
+      return p->hist_size[p->hist_count - 1];
+  }
+  return 0;
+}
+
+// lifetime in requests, UINT64_MAX for blocks that live forever
+static uint64_t draw_life(const phase_t* p) {
+  switch (p->life) {
+    case LIFE_FIXED:
+      return (uint64_t)p->life_a;
+    case LIFE_UNIFORM:
+      return (uint64_t)(p->life_a + rng_unit() * (p->life_b - p->life_a));
+    case LIFE_EXP:
+      return (uint64_t)(-log(1 - rng_unit()) * p->life_a);
+    case LIFE_FOREVER:
+      return UINT64_MAX;
+  }
+  return 0;
+}
+
+/*
+ * The live blocks sit in a binary min-heap on the request their next resize
+ * or free is due at.
+ */
+static block_t* heap;
+static size_t heap_count;
+static size_t heap_cap;
+
+// the request of the next resize of b, spread evenly over its life, or of
+// its free once it has no resizes left
+static uint64_t next_due(const block_t* b, uint64_t now) {
+  if (b->steps == 0) return b->death;
+  if (b->death == UINT64_MAX) return now + REALLOC_GAP;
+  if (b->death <= now) return now;
+  return now + (b->death - now) / (b->steps + 1) + 1;
+}
+
+static void heap_swap(size_t i, size_t j) {
+  block_t t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+}
+
+static void heap_down(size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < heap_count && heap[l].due < heap[m].due) m = l;
+    if (r < heap_count && heap[r].due < heap[m].due) m = r;
+    if (m == i) return;
+    heap_swap(i, m);
+    i = m;
+  }
+}
+
+static void heap_push(const block_t* b) {
+  if (heap_count == heap_cap) {
+    heap_cap = (heap_cap != 0) ? 2 * heap_cap : 1024;
+    if ((heap = (block_t*)realloc(heap, heap_cap * sizeof(block_t))) == NULL) {
+      perror("trace_gen");
+      exit(1);
+    }
+  }
+  size_t i = heap_count++;
+  heap[i] = *b;
+  while (i > 0 && heap[(i - 1) / 2].due > heap[i].due) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void heap_pop(void) {
+  heap[0] = heap[--heap_count];
+  heap_down(0);
+}
+
+/*
+ * The trace is written as it is generated, after a header with room for
+ * the final counts, which are filled in at the end.
+ */
+static FILE* out;
+static int binary;
+static int last_thread = -1;
+static uint64_t num_ops;
+static uint64_t num_ids;
+
+static void emit(traceop_type type, uint64_t id, uint64_t size, int thread) {
+  num_ops++;
+  if (binary) {
+    traceop_t op = {type, (int)id, (int)size, thread};
+    fwrite(&op, sizeof(op), 1, out);
+    return;
+  }
+  if (thread != last_thread) {
+    fprintf(out, "t %d\n", thread);
+    last_thread = thread;
+  }
+  switch (type) {
+    case ALLOC:
+      fprintf(out, "a %llu %llu\n", (unsigned long long)id,
+              (unsigned long long)size);
+      break;
+    case REALLOC:
+      fprintf(out, "r %llu %llu\n", (unsigned long long)id,
+              (unsigned long long)size);
+      break;
+    default:
+      fprintf(out, "f %llu\n", (unsigned long long)id);
+      break;
+  }
+}
+
+static void write_header(uint64_t heap_size, int threads) {
+  rewind(out);
+  if (binary) {
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.byte_order = TRACE_BYTE_ORDER;
+    hdr.op_size = sizeof(traceop_t);
+    hdr.sugg_heapsize = (int32_t)heap_size;
+    hdr.num_ids = (int32_t)num_ids;
+    hdr.num_ops = (int32_t)num_ops;
+    hdr.weight = 1;
+    hdr.num_threads = threads;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+  } else {
+    // fixed width, so that the final counts fit over the first ones
+    fprintf(out, "%20llu\n%20llu\n%20llu\n%20d\n",
+            (unsigned long long)heap_size, (unsigned long long)num_ids,
+            (unsigned long long)num_ops, 1);
+  }
+}
+
+// the thread that frees a block of thread t
+static int free_thread(const phase_t* p, int t, int threads) {
+  if (threads == 1 || rng_unit() >= p->handoff) return t;
+  return (t + 1 + rng_next() % (threads - 1)) % threads;
+}
+
+/*
+ * run_phase - generate the requests of one phase, starting at request now
+ */
+static uint64_t run_phase(const phase_t* p, double scale, int threads,
+                          uint64_t now, uint64_t* live) {
+  uint64_t end = now + (uint64_t)(p->ops * scale);
+  uint64_t target = (uint64_t)(p->live * scale);
+
+  while (now < end) {
+    block_t* b = (heap_count != 0) ? &heap[0] : NULL;
+    if (b != NULL && (b->due <= now || *live >= target)) {
+      // the next resize or free, early if the heap is over its target
+      if (b->steps > 0 && b->due <= now && b->death > now) {
+        uint64_t size = (uint64_t)(b->size * p->realloc_growth);
+        size = (size != 0) ? size : 1;
+        *live += size - b->size;
+        b->size = size;
+        b->steps--;
+        emit(REALLOC, b->id, size, b->thread);
+        b->due = next_due(b, now);
+        heap_down(0);
+      } else {
+        *live -= b->size;
+        emit(FREE, b->id, 0, free_thread(p, b->thread, threads));
+        heap_pop();
+      }
+    } else {
+      block_t nb;
+      nb.id = num_ids++;
+      nb.size = draw_size(p);
+      nb.thread = rng_next() % threads;
+      uint64_t life = draw_life(p);
+      nb.death = (life > UINT64_MAX - now) ? UINT64_MAX : now + life + 1;
+      nb.steps = (rng_unit() < p->realloc_p) ? p->realloc_steps : 0;
+      nb.due = next_due(&nb, now);
+      *live += nb.size;
+      emit(ALLOC, nb.id, nb.size, nb.thread);
+      heap_push(&nb);
+    }
+    now++;
+  }
+  return now;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: trace_gen [-b] [-s <seed>] [-x <scale>] <spec> <out>\n");
+}
+
+int main(int argc, char** argv) {
+  int c;
+  int seed_set = 0;
+  uint64_t seed = 1, seed_arg = 0;
+  double scale = 1, scale_arg = 1;
+  int threads = 1;
+  phase_t* phases = NULL;
+
+  while ((c = getopt(argc, argv, "bs:x:h")) != -1) {
+    switch (c) {
+      case 'b':
+        binary = 1;
+        break;
+      case 's':
+        seed_arg = strtoull(optarg, NULL, 0);
+        seed_set = 1;
+        break;
+      case 'x':
+        scale_arg = atof(optarg);
+        if (scale_arg <= 0) {
+          usage();
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return c != 'h';
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+    return 1;
+  }
+
+  int num_phases = parse_spec(argv[optind], &phases, &seed, &scale, &threads);
+  if (seed_set) seed = seed_arg;
+  scale *= scale_arg;
+  rng_state = seed * 0x9e3779b97f4a7c15ULL | 1;
+
+  if ((out = fopen(argv[optind + 1], "wb")) == NULL) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  write_header(0, threads);
+
+  uint64_t now = 0, live = 0, max_live = 0;
+  for (int i = 0; i < num_phases; i++) {
+    now = run_phase(&phases[i], scale, threads, now, &live);
+    uint64_t target = (uint64_t)(phases[i].live * scale);
+    max_live = (target > max_live) ? target : max_live;
+  }
+  // free what is left, in the order it comes due
+  while (heap_count != 0) {
+    const phase_t* p = &phases[num_phases - 1];
+    emit(FREE, heap[0].id, 0, free_thread(p, heap[0].thread, threads));
+    heap_pop();
+  }
+
+  write_header(max_live, threads);
+  if (fclose(out) != 0) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  free(heap);
+  free(phases);
+  return 0;
+}
@@ -0,0 +1,627 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+#define _GNU_SOURCE
+#include "./trace_record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./memlib.h"
+#include "./trace.h"
+
+_Static_assert(REC_ALLOC == ALLOC && REC_FREE == FREE && REC_REALLOC == REALLOC,
+               "recorded request types are traceop_types");
+
+// requests a thread can log before the flusher has to catch up, and how
+// often the flusher runs when no ring is filling up
+#define REC_RING (1 << 16)
+#define REC_FLUSH_MS 10
+
+// the recorder never calls malloc; its rings and tables come from mem_map
+#define REC_OUT (1 << 16)
+
+// one logged request
+typedef struct {
+  uint64_t ts;  // CLOCK_MONOTONIC ns: before a free, after an allocation
+  void* ptr;    // block allocated, resized to, or freed; NULL for a realloc
+                // that failed
+  void* old;    // block resized, for a realloc and its release
+  size_t size;
+  int type;
+  int thread;   // set by the flusher
+  int deferred; // held back a round by the flusher for a conflict of its own
+} rec_event;
+
+#define RING_LIVE 0
+#define RING_DEAD 1  // its thread exited, the flusher frees it once drained
+#define RING_FREE 2  // drained, ready for a new thread
+
+// the requests of one thread. The thread appends at tail, the flusher
+// consumes from head.
+typedef struct rec_ring {
+  struct rec_ring* next;  // every ring, newest first
+  int thread;             // number of the thread in the trace
+  int state;
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t head __attribute__((aligned(64)));
+  // flusher only: the end of this round's requests and the next ring with
+  // requests in this round
+  uint64_t snap;
+  struct rec_ring* active;
+  rec_event ev[REC_RING];
+} rec_ring;
+
+// a growable array of events carried from one round to the next
+typedef struct {
+  rec_event* ev;
+  size_t count;
+  size_t cap;
+} rec_events;
+
+// open addressing tables keyed by block address: the live blocks and their
+// ids, and the blocks whose requests are held back in the current round
+typedef struct {
+  void* ptr;  // NULL for an empty slot
+  uint64_t id;
+} rec_slot;
+
+typedef struct {
+  rec_slot* slots;
+  int bits;
+  size_t count;
+} rec_table;
+
+int rec_on = 0;
+
+static rec_ring* rings;
+static int rec_threads;
+static __thread rec_ring* rec_tls __attribute__((tls_model("initial-exec")));
+// set on the flusher, so that anything it allocates is not recorded
+static __thread int in_rec __attribute__((tls_model("initial-exec")));
+static pthread_key_t rec_key;
+
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rec_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t rec_flusher_thread;
+static int rec_stop;  // written under rec_lock, read atomically by rec_log
+
+// flusher state
+static int rec_fd = -1;
+static int rec_binary;
+static char rec_path[4096];
+static rec_events held;     // held back last round, replayed in this one
+static rec_events carried;  // held back in this round
+static rec_table live;
+static rec_table blocked;
+// ids of the blocks whose realloc has started but not returned, by thread
+static rec_table released;
+static uint64_t next_id;
+static uint64_t num_ops;
+static int last_thread = -1;
+static int max_thread;
+static size_t stalls;
+static size_t unmatched;
+static char out[REC_OUT];
+static size_t out_len;
+
+static uint64_t rec_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * rec_ring_release - pthread key destructor: hand the ring of an exiting
+ *    thread to the flusher, which frees it once it has been drained
+ */
+static void rec_ring_release(void* arg) {
+  rec_ring* r = (rec_ring*)arg;
+  rec_tls = NULL;
+  __atomic_store_n(&r->state, RING_DEAD, __ATOMIC_RELEASE);
+}
+
+/*
+ * rec_attach - give this thread a ring, a drained one if there is one
+ */
+static rec_ring* rec_attach(void) {
+  rec_ring* r;
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    int state = RING_FREE;
+    if (__atomic_compare_exchange_n(&r->state, &state, RING_LIVE, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (r == NULL) {
+    r = (rec_ring*)mem_map(sizeof(rec_ring));
+    if (r == (void*)-1) return NULL;
+    r->state = RING_LIVE;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  // a new number even for a reused ring, the flusher has drained it
+  r->thread = __atomic_fetch_add(&rec_threads, 1, __ATOMIC_RELAXED);
+  rec_tls = r;
+  pthread_setspecific(rec_key, r);
+  return r;
+}
+
+/*
+ * rec_log - append a request to this thread's ring. Waits for the flusher
+ *    if the ring is full, so no request is ever lost while it runs; once
+ *    recording has stopped, a request that finds the ring full is dropped.
+ */
+void rec_log(int type, void* p, void* old, size_t size) {
+  if (in_rec) return;
+  rec_ring* r = rec_tls;
+  if (r == NULL) {
+    in_rec = 1;
+    r = rec_attach();
+    in_rec = 0;
+    if (r == NULL) return;
+  }
+  uint64_t t = r->tail;
+  if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= REC_RING) {
+    __atomic_fetch_add(&stalls, 1, __ATOMIC_RELAXED);
+    do {
+      // the flusher is gone, nothing will drain the ring again
+      if (__atomic_load_n(&rec_stop, __ATOMIC_RELAXED)) return;
+      pthread_cond_signal(&rec_cond);
+      sched_yield();
+    } while (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= REC_RING);
+  }
+  rec_event* e = &r->ev[t & (REC_RING - 1)];
+  e->ts = rec_now();
+  e->ptr = p;
+  e->old = old;
+  e->size = size;
+  e->type = type;
+  e->deferred = 0;
+  __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+  // wake the flusher early once the ring is half full
+  if (((t + 1) & (REC_RING / 2 - 1)) == 0) pthread_cond_signal(&rec_cond);
+}
+
+static void out_flush(void) {
+  size_t done = 0;
+  while (done < out_len) {
+    ssize_t n = write(rec_fd, out + done, out_len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  out_len = 0;
+}
+
+/*
+ * rec_emit - write one request of the trace
+ */
+static void rec_emit(int type, uint64_t id, size_t size, int thread) {
+  if (sizeof(out) - out_len < 128) out_flush();
+  num_ops++;
+  max_thread = (thread > max_thread) ? thread : max_thread;
+  if (rec_binary) {
+    traceop_t op = {(traceop_type)type, (int)id, (int)size, thread};
+    memcpy(out + out_len, &op, sizeof(op));
+    out_len += sizeof(op);
+    return;
+  }
+  if (thread != last_thread) {
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "t %d\n", thread);
+    last_thread = thread;
+  }
+  if (type == FREE) {
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "f %llu\n",
+                        (unsigned long long)id);
+  } else {
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "%c %llu %zu\n",
+                        (type == ALLOC) ? 'a' : 'r', (unsigned long long)id,
+                        size);
+  }
+}
+
+/*
+ * rec_header - write the trace header, which leads the file. Written once
+ *    with zero counts when the file is opened, and again at the end.
+ */
+static void rec_header(void) {
+  if (rec_binary) {
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.byte_order = TRACE_BYTE_ORDER;
+    hdr.op_size = sizeof(traceop_t);
+    hdr.num_ids = (int32_t)next_id;
+    hdr.num_ops = (int32_t)num_ops;
+    hdr.weight = 1;
+    hdr.num_threads = max_thread + 1;
+    pwrite(rec_fd, &hdr, sizeof(hdr), 0);
+  } else {
+    // fixed width, so that the final counts fit over the first ones
+    char hdr[4 * 21 + 1];
+    snprintf(hdr, sizeof(hdr), "%20d\n%20llu\n%20llu\n%20d\n", 0,
+             (unsigned long long)next_id, (unsigned long long)num_ops, 1);
+    pwrite(rec_fd, hdr, 4 * 21, 0);
+  }
+}
+
+static size_t table_hash(const rec_table* t, void* p) {
+  return (size_t)(((uintptr_t)p * 0x9e3779b97f4a7c15ULL) >> (64 - t->bits));
+}
+
+// the slot of p, or the empty slot it would go in
+static rec_slot* table_find(const rec_table* t, void* p) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  for (size_t i = table_hash(t, p);; i = (i + 1) & mask) {
+    rec_slot* s = &t->slots[i];
+    if (s->ptr == NULL || s->ptr == p) return s;
+  }
+}
+
+static int table_resize(rec_table* t, int bits) {
+  rec_slot* old = t->slots;
+  size_t old_slots = (old != NULL) ? (size_t)1 << t->bits : 0;
+  rec_slot* slots = (rec_slot*)mem_map(sizeof(rec_slot) << bits);
+  if (slots == (void*)-1) return -1;
+  t->slots = slots;
+  t->bits = bits;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].ptr != NULL) *table_find(t, old[i].ptr) = old[i];
+  }
+  if (old != NULL) mem_unmap(old, sizeof(rec_slot) * old_slots);
+  return 0;
+}
+
+// the slot for p, which the caller fills in if it was empty
+static rec_slot* table_insert(rec_table* t, void* p) {
+  if (2 * (t->count + 1) > (size_t)1 << t->bits &&
+      table_resize(t, t->bits + 1) < 0) {
+    return NULL;
+  }
+  rec_slot* s = table_find(t, p);
+  if (s->ptr == NULL) {
+    s->ptr = p;
+    t->count++;
+  }
+  return s;
+}
+
+// empty slot s, moving back the entries after it that it would hide
+static void table_remove(rec_table* t, rec_slot* s) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  size_t hole = s - t->slots;
+  for (size_t i = (hole + 1) & mask; t->slots[i].ptr != NULL;
+       i = (i + 1) & mask) {
+    size_t home = table_hash(t, t->slots[i].ptr);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      t->slots[hole] = t->slots[i];
+      hole = i;
+    }
+  }
+  t->slots[hole].ptr = NULL;
+  t->count--;
+}
+
+static void table_clear(rec_table* t) {
+  if (t->count == 0) return;
+  memset(t->slots, 0, sizeof(rec_slot) << t->bits);
+  t->count = 0;
+}
+
+static int events_push(rec_events* a, const rec_event* e) {
+  if (a->count == a->cap) {
+    size_t cap = (a->cap != 0) ? 2 * a->cap : 1024;
+    rec_event* ev = (rec_event*)mem_map(cap * sizeof(rec_event));
+    if (ev == (void*)-1) return -1;
+    if (a->ev != NULL) {
+      memcpy(ev, a->ev, a->count * sizeof(rec_event));
+      mem_unmap(a->ev, a->cap * sizeof(rec_event));
+    }
+    a->ev = ev;
+    a->cap = cap;
+  }
+  a->ev[a->count++] = *e;
+  return 0;
+}
+
+// hold e back to the next round, along with every later request on its
+// blocks, which may depend on it
+static void rec_defer(rec_event* e, int conflict) {
+  e->deferred |= conflict;
+  if (events_push(&carried, e) < 0) unmatched++;
+  if (e->ptr != NULL) table_insert(&blocked, e->ptr);
+  if (e->old != NULL) table_insert(&blocked, e->old);
+}
+
+// the key of thread in released, never NULL
+#define thread_key(thread) ((void*)((uintptr_t)(thread) + 1))
+
+// the id of a released block that was never recorded
+#define NO_ID UINT64_MAX
+
+// drop the id of p, whose free was never logged
+static void rec_forget(rec_slot* s, int thread) {
+  rec_emit(FREE, s->id, 0, thread);
+  table_remove(&live, s);
+  unmatched++;
+}
+
+/*
+ * rec_apply - turn one logged request into a request of the trace.
+ *    Requests of one thread reach the flusher in order, but another
+ *    thread's request on the same block may not have been drained yet: a
+ *    free that made the block available, or the allocation of a block
+ *    freed here. Such requests are held back a round, by which time the
+ *    other request is in a ring. When a request still does not match after
+ *    that, the block was allocated before recording started or outside the
+ *    wrapper: a free of it is dropped, a realloc of it becomes an allocation.
+ *    A realloc comes in two halves, stamped before and after the call: the
+ *    first takes the old block out of the live ones, so that whoever gets
+ *    it next is not mistaken for its owner, and the second gives the old
+ *    block's id to the new one.
+ */
+static void rec_apply(rec_event* e, int force) {
+  int retry = force || e->deferred;
+  if (blocked.count != 0 &&
+      (table_find(&blocked, e->ptr)->ptr != NULL ||
+       (e->old != NULL && table_find(&blocked, e->old)->ptr != NULL))) {
+    rec_defer(e, 0);
+    return;
+  }
+
+  rec_slot* s;
+  uint64_t id;
+  switch (e->type) {
+    case FREE:
+      s = table_find(&live, e->ptr);
+      if (s->ptr == NULL) {
+        if (!retry) {
+          rec_defer(e, 1);
+        } else {
+          unmatched++;
+        }
+        return;
+      }
+      rec_emit(FREE, s->id, 0, e->thread);
+      table_remove(&live, s);
+      return;
+
+    case REC_RELEASE:
+      s = table_find(&live, e->old);
+      if (s->ptr == NULL && !retry) {
+        rec_defer(e, 1);
+        return;
+      }
+      id = NO_ID;
+      if (s->ptr != NULL) {
+        id = s->id;
+        table_remove(&live, s);
+      } else {
+        unmatched++;
+      }
+      if ((s = table_insert(&released, thread_key(e->thread))) == NULL) {
+        return;
+      }
+      s->id = id;
+      return;
+
+    case REALLOC:
+      s = table_find(&released, thread_key(e->thread));
+      if (s->ptr == NULL) {
+        // the first half was not recorded
+        unmatched++;
+        id = NO_ID;
+      } else {
+        if (e->ptr != NULL) {
+          rec_slot* to = table_find(&live, e->ptr);
+          if (to->ptr != NULL) {
+            if (!retry) {
+              rec_defer(e, 1);
+              return;
+            }
+            rec_forget(to, e->thread);
+          }
+        }
+        id = s->id;
+        table_remove(&released, s);
+      }
+      if (e->ptr == NULL) {
+        // the realloc failed and the old block is still there
+        if (id != NO_ID && (s = table_insert(&live, e->old)) != NULL) {
+          s->id = id;
+        }
+        return;
+      }
+      if (id != NO_ID) {
+        if ((s = table_insert(&live, e->ptr)) == NULL) return;
+        s->id = id;
+        rec_emit(REALLOC, id, e->size, e->thread);
+        return;
+      }
+      // fall through: the old block is unknown, record a new one
+    case ALLOC:
+      s = table_find(&live, e->ptr);
+      if (s->ptr != NULL) {
+        if (!retry) {
+          rec_defer(e, 1);
+          return;
+        }
+        rec_forget(s, e->thread);
+      }
+      if ((s = table_insert(&live, e->ptr)) == NULL) return;
+      s->id = next_id++;
+      rec_emit(ALLOC, s->id, e->size, e->thread);
+      return;
+  }
+}
+
+/*
+ * rec_round - drain every ring and write its requests to the trace,
+ *    merged with the ones held back last round in time order. The final
+ *    round forces through whatever still does not match.
+ */
+static void rec_round(int force) {
+  rec_ring* active = NULL;
+  for (rec_ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+       r = r->next) {
+    int state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    r->snap = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head != r->snap) {
+      r->active = active;
+      active = r;
+    } else if (state == RING_DEAD) {
+      __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+    }
+  }
+
+  // last round's held back requests are merged in as one more ring, and
+  // this round's collect in the array that held the ones before
+  rec_events prev = held;
+  held = carried;
+  carried = prev;
+  carried.count = 0;
+  size_t next_held = 0;
+
+  table_clear(&blocked);
+  for (;;) {
+    rec_event* min = NULL;
+    rec_ring* from = NULL;
+    if (next_held < held.count) min = &held.ev[next_held];
+    for (rec_ring* r = active; r != NULL; r = r->active) {
+      if (r->head == r->snap) continue;
+      rec_event* e = &r->ev[r->head & (REC_RING - 1)];
+      if (min == NULL || e->ts < min->ts) {
+        min = e;
+        from = r;
+      }
+    }
+    if (min == NULL) break;
+    if (from != NULL) {
+      min->thread = from->thread;
+      rec_apply(min, force);
+      __atomic_store_n(&from->head, from->head + 1, __ATOMIC_RELEASE);
+    } else {
+      rec_apply(min, force);
+      next_held++;
+    }
+  }
+}
+
+static void* rec_flusher(void* arg) {
+  in_rec = 1;
+  pthread_mutex_lock(&rec_lock);
+  while (!rec_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += REC_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&rec_cond, &rec_lock, &deadline);
+    rec_round(0);
+  }
+  pthread_mutex_unlock(&rec_lock);
+  return NULL;
+}
+
+/*
+ * rec_exit - stop recording, write out what is left and finish the header
+ */
+static void rec_exit(void) {
+  in_rec = 1;
+  __atomic_store_n(&rec_on, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&rec_lock);
+  __atomic_store_n(&rec_stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&rec_cond);
+  pthread_mutex_unlock(&rec_lock);
+  pthread_join(rec_flusher_thread, NULL);
+
+  rec_round(0);
+  rec_round(1);
+  out_flush();
+  rec_header();
+  close(rec_fd);
+  fprintf(stderr,
+          "mymalloc: recorded %llu requests of %d threads to %s "
+          "(%zu unmatched, %zu stalls)\n",
+          (unsigned long long)num_ops, max_thread + 1, rec_path, unmatched,
+          stalls);
+}
+
+// the child of a fork has no flusher, and does not record
+static void rec_fork_child(void) { rec_on = 0; }
+
+/*
+ * rec_init - start recording if MYMALLOC_TRACE names a trace file
+ */
+void rec_init(void) {
+  const char* name = getenv("MYMALLOC_TRACE");
+  if (name == NULL || *name == '\0') return;
+  const char* format = getenv("MYMALLOC_TRACE_FORMAT");
+  rec_binary = (format != NULL && strcmp(format, "binary") == 0);
+
+  // %p stands for the pid, so that each process of a job gets its own file
+  const char* pid = strstr(name, "%p");
+  if (pid != NULL) {
+    snprintf(rec_path, sizeof(rec_path), "%.*s%d%s", (int)(pid - name), name,
+             (int)getpid(), pid + 2);
+  } else {
+    snprintf(rec_path, sizeof(rec_path), "%s", name);
+  }
+  const char* path = rec_path;
+
+  rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (rec_fd < 0 || table_resize(&live, 16) < 0 ||
+      table_resize(&blocked, 8) < 0 || table_resize(&released, 6) < 0) {
+    fprintf(stderr, "mymalloc: cannot record a trace to %s\n", path);
+    if (rec_fd >= 0) close(rec_fd);
+    return;
+  }
+  rec_header();
+  lseek(rec_fd, 0, SEEK_END);
+
+  in_rec = 1;
+  pthread_key_create(&rec_key, rec_ring_release);
+  if (pthread_create(&rec_flusher_thread, NULL, rec_flusher, NULL) != 0) {
+    fprintf(stderr, "mymalloc: cannot start the trace flusher\n");
+    close(rec_fd);
+    in_rec = 0;
+    return;
+  }
+  pthread_atfork(NULL, NULL, rec_fork_child);
+  atexit(rec_exit);
+  in_rec = 0;
+  __atomic_store_n(&rec_on, 1, __ATOMIC_RELEASE);
+}
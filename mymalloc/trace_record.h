@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2020 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/**
+ * trace_record.h
+ *
+ * Allocation trace recorder for malloc_wrapper.so. Setting MYMALLOC_TRACE to
+ * a file name records every allocation and free of the process into that
+ * file as an mdriver trace, with the pointers turned into dense ids and each
+ * request tagged with the thread that made it. A %p in the name is replaced
+ * by the pid. MYMALLOC_TRACE_FORMAT=binary writes the binary trace format
+ * instead of text.
+ *
+ * Threads log their requests with a timestamp into rings of their own,
+ * without locks; a background thread merges the rings in time order and
+ * writes the trace out.
+ **/
+
+#ifndef MM_TRACE_RECORD_H
+#define MM_TRACE_RECORD_H
+
+#include <stddef.h>
+
+// set while the recorder is on
+extern int rec_on;
+
+void rec_init(void);
+void rec_log(int type, void* p, void* old, size_t size);
+
+// the request types, as in traceop_type
+#define REC_ALLOC 0
+#define REC_FREE 1
+#define REC_REALLOC 2
+// not a request of the trace: the start of a realloc, see rec_realloc_begin
+#define REC_RELEASE 4
+
+// log the block p of size bytes, before p is handed out
+static inline void rec_malloc(void* p, size_t size) {
+  if (!rec_on || p == NULL) return;
+  rec_log(REC_ALLOC, p, NULL, size);
+}
+
+// log the free of p, before p is freed and may be handed out again
+static inline void rec_free(void* p) {
+  if (!rec_on || p == NULL) return;
+  rec_log(REC_FREE, p, NULL, 0);
+}
+
+// log that old is about to be resized. A realloc that moves frees old
+// before it returns, and another thread may get old back and log it first,
+// so old is let go of here, stamped before the call
+static inline void rec_realloc_begin(void* old) {
+  if (!rec_on || old == NULL) return;
+  rec_log(REC_RELEASE, old, old, 0);
+}
+
+// log that old was resized to size bytes at p, or that it stayed where it
+// was if p is NULL
+static inline void rec_realloc(void* old, void* p, size_t size) {
+  if (!rec_on || (old == NULL && p == NULL)) return;
+  rec_log((old == NULL) ? REC_ALLOC : REC_REALLOC, p, old, size);
+}
+
+#endif  // MM_TRACE_RECORD_H